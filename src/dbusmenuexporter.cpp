@@ -22,10 +22,12 @@
 
 // Qt
 #include <QBuffer>
+#include <QDBusServer>
 #include <QDateTime>
 #include <QMap>
 #include <QMenu>
 #include <QSet>
+#include <QThread>
 #include <QTimer>
 #include <QToolButton>
 #include <QWidgetAction>
@@ -37,10 +39,12 @@
 #include "dbusmenuexporterprivate_p.h"
 #include "dbusmenutypes_p.h"
 #include "dbusmenushortcut_p.h"
+#include "dbusmenusnapshot_p.h"
 #include "debug_p.h"
 #include "utils_p.h"
 
 static const char *KMENU_TITLE = "kmenu_title";
+static const char *ICON_DATA_HASH_PROPERTY = "x-qt-icon-data-hash";
 
 //-------------------------------------------------
 //
@@ -246,9 +250,86 @@ void DBusMenuExporterPrivate::insertIconProperty(QVariantMap *map, QAction *acti
         QBuffer buffer;
         icon.pixmap(16).save(&buffer, "PNG");
         map->insert("icon-data", buffer.data());
+        map->insert(ICON_DATA_HASH_PROPERTY, iconDataHash(buffer.data()));
     }
 }
 
+QDBusConnection DBusMenuExporterPrivate::connection() const
+{
+    return QDBusConnection(m_connectionName);
+}
+
+QList<QDBusConnection> DBusMenuExporterPrivate::connections()
+{
+    QList<QDBusConnection> list;
+    list << connection();
+
+    QStringList::Iterator it = m_peerConnectionNames.begin();
+    while (it != m_peerConnectionNames.end()) {
+        QDBusConnection peer(*it);
+        if (peer.isConnected()) {
+            list << peer;
+            ++it;
+        } else {
+            QDBusConnection::disconnectFromPeer(*it);
+            it = m_peerConnectionNames.erase(it);
+        }
+    }
+    return list;
+}
+
+QObject *DBusMenuExporterPrivate::exportedObject() const
+{
+    if (m_snapshotObject) {
+        return m_snapshotObject;
+    }
+    return m_dbusObject;
+}
+
+void DBusMenuExporterPrivate::registerObject(QDBusConnection connection)
+{
+    connection.registerObject(m_objectPath, exportedObject(), QDBusConnection::ExportAllContents);
+}
+
+void DBusMenuExporterPrivate::updateSnapshot()
+{
+    if (!m_snapshotObject) {
+        return;
+    }
+    DBusMenuSnapshot *snapshot = new DBusMenuSnapshot;
+    snapshot->revision = m_revision;
+    fillSnapshotItem(snapshot, 0, m_rootMenu);
+    m_snapshotObject->setSnapshot(DBusMenuSnapshotPointer(snapshot));
+}
+
+void DBusMenuExporterPrivate::flushChangesToSnapshot()
+{
+    if (m_itemUpdatedIds.isEmpty()) {
+        updateSnapshot();
+    } else {
+        // Updates the snapshot as well
+        q->doUpdateActions();
+    }
+}
+
+void DBusMenuExporterPrivate::fillSnapshotItem(DBusMenuSnapshot *snapshot, int id, QMenu *menu)
+{
+    DBusMenuSnapshot::Item item;
+    // QVariantMap is implicitly shared: this does not copy the properties
+    item.properties = m_dbusObject->allProperties(id);
+    if (menu) {
+        Q_FOREACH(QAction *action, menu->actions()) {
+            int actionId = m_idForAction.value(action, -1);
+            if (actionId == -1) {
+                continue;
+            }
+            item.children << actionId;
+            fillSnapshotItem(snapshot, actionId, action->menu());
+        }
+    }
+    snapshot->items.insert(id, item);
+}
+
 static void collapseSeparator(QAction* action)
 {
     action->setVisible(false);
@@ -332,6 +413,7 @@ DBusMenuExporter::DBusMenuExporter(const QString &objectPath, QMenu *menu, const
 {
     d->q = this;
     d->m_objectPath = objectPath;
+    d->m_connectionName = _connection.name();
     d->m_rootMenu = menu;
     d->m_nextId = 1;
     d->m_revision = 1;
@@ -339,6 +421,9 @@ DBusMenuExporter::DBusMenuExporter(const QString &objectPath, QMenu *menu, const
     d->m_itemUpdatedTimer = new QTimer(this);
     d->m_layoutUpdatedTimer = new QTimer(this);
     d->m_dbusObject = new DBusMenuExporterDBus(this);
+    d->m_snapshotThread = 0;
+    d->m_snapshotObject = 0;
+    d->m_peerServer = 0;
 
     d->addMenu(d->m_rootMenu, 0);
 
@@ -350,15 +435,133 @@ DBusMenuExporter::DBusMenuExporter(const QString &objectPath, QMenu *menu, const
     d->m_layoutUpdatedTimer->setSingleShot(true);
     connect(d->m_layoutUpdatedTimer, SIGNAL(timeout()), SLOT(doEmitLayoutUpdated()));
 
-    QDBusConnection connection(_connection);
-    connection.registerObject(objectPath, d->m_dbusObject, QDBusConnection::ExportAllContents);
+    d->registerObject(_connection);
 }
 
 DBusMenuExporter::~DBusMenuExporter()
 {
+    setPeerToPeerEnabled(false);
+    if (d->m_snapshotThread) {
+        d->m_snapshotThread->quit();
+        d->m_snapshotThread->wait();
+        delete d->m_snapshotObject;
+    }
     delete d;
 }
 
+void DBusMenuExporter::setSnapshotEnabled(bool enabled)
+{
+    if (enabled == isSnapshotEnabled()) {
+        return;
+    }
+    QList<QDBusConnection> connections = d->connections();
+    Q_FOREACH(QDBusConnection connection, connections) {
+        connection.unregisterObject(d->m_objectPath);
+    }
+
+    if (enabled) {
+        // Make sure the first snapshot is complete
+        doUpdateActions();
+
+        d->m_snapshotObject = new DBusMenuSnapshotDBus(d->m_dbusObject);
+        d->updateSnapshot();
+        d->m_snapshotThread = new QThread(this);
+        d->m_snapshotObject->moveToThread(d->m_snapshotThread);
+        d->m_snapshotThread->start();
+    } else {
+        d->m_snapshotThread->quit();
+        d->m_snapshotThread->wait();
+        delete d->m_snapshotObject;
+        d->m_snapshotObject = 0;
+        delete d->m_snapshotThread;
+        d->m_snapshotThread = 0;
+    }
+
+    Q_FOREACH(const QDBusConnection &connection, connections) {
+        d->registerObject(connection);
+    }
+}
+
+bool DBusMenuExporter::isSnapshotEnabled() const
+{
+    return d->m_snapshotObject != 0;
+}
+
+void DBusMenuExporter::deferAboutToShow(QMenu *menu)
+{
+    DMRETURN_IF_FAIL(menu);
+    d->m_dbusObject->m_deferredMenus << menu;
+}
+
+void DBusMenuExporter::finishAboutToShow(QMenu *menu)
+{
+    DMRETURN_IF_FAIL(menu);
+    d->m_dbusObject->completeAboutToShow(menu);
+}
+
+void DBusMenuExporter::setAboutToShowTimeout(int msecs)
+{
+    d->m_dbusObject->m_aboutToShowTimeout = msecs;
+}
+
+int DBusMenuExporter::aboutToShowTimeout() const
+{
+    return d->m_dbusObject->m_aboutToShowTimeout;
+}
+
+void DBusMenuExporter::setPeerToPeerEnabled(bool enabled)
+{
+    if (enabled == isPeerToPeerEnabled()) {
+        return;
+    }
+    if (enabled) {
+        d->m_peerServer = new QDBusServer("unix:tmpdir=/tmp", this);
+        if (!d->m_peerServer->isConnected()) {
+            DMWARNING << "Could not listen for peer connections:" << d->m_peerServer->lastError().message();
+            delete d->m_peerServer;
+            d->m_peerServer = 0;
+            return;
+        }
+        connect(d->m_peerServer, SIGNAL(newConnection(QDBusConnection)),
+            SLOT(slotNewPeerConnection(QDBusConnection)));
+    } else {
+        Q_FOREACH(const QString &name, d->m_peerConnectionNames) {
+            QDBusConnection(name).unregisterObject(d->m_objectPath);
+            QDBusConnection::disconnectFromPeer(name);
+        }
+        d->m_peerConnectionNames.clear();
+        delete d->m_peerServer;
+        d->m_peerServer = 0;
+    }
+    if (d->m_snapshotObject) {
+        d->m_snapshotObject->setPeerAddress(d->m_dbusObject->GetPeerAddress());
+    }
+}
+
+bool DBusMenuExporter::isPeerToPeerEnabled() const
+{
+    return d->m_peerServer != 0;
+}
+
+void DBusMenuExporter::setFileDescriptorPassingEnabled(bool enabled)
+{
+    d->m_dbusObject->m_layoutFdEnabled = enabled;
+    if (d->m_snapshotObject) {
+        d->m_snapshotObject->setLayoutFdEnabled(enabled);
+    }
+}
+
+bool DBusMenuExporter::isFileDescriptorPassingEnabled() const
+{
+    return d->m_dbusObject->m_layoutFdEnabled;
+}
+
+void DBusMenuExporter::slotNewPeerConnection(const QDBusConnection &connection)
+{
+    d->m_peerConnectionNames << connection.name();
+    d->registerObject(connection);
+}
+
 void DBusMenuExporter::doUpdateActions()
 {
     if (d->m_itemUpdatedIds.isEmpty()) {
@@ -409,6 +612,13 @@ void DBusMenuExporter::doUpdateActions()
 
         // Update our data (oldProperties is a reference)
         oldProperties = newProperties;
+
+        // ItemsPropertiesUpdated is broadcast to all the clients, including
+        // those which do not know about the hash and need icon-data, so
+        // icon-data is still sent. Clients which know about the hash compute
+        // it from icon-data.
+        updatedProperties.remove(ICON_DATA_HASH_PROPERTY);
+        removedProperties.removeAll(ICON_DATA_HASH_PROPERTY);
         QMenu *menu = action->menu();
         if (menu) {
             d->addMenu(menu, id);
@@ -428,6 +638,7 @@ void DBusMenuExporter::doUpdateActions()
         }
     }
     d->m_itemUpdatedIds.clear();
+    d->updateSnapshot();
     if (!d->m_emittedLayoutUpdatedOnce) {
         // No need to tell the world about action changes: nobody knows the
         // menu layout so nobody knows about the actions.
@@ -451,6 +662,12 @@ void DBusMenuExporter::doEmitLayoutUpdated()
         }
     }
 
+    if (d->m_snapshotObject) {
+        // Collapsing separators changes action properties: flush them so
+        // that the snapshot is up to date before we announce the new layout
+        d->flushChangesToSnapshot();
+    }
+
     // Tell the world about the update
     if (d->m_emittedLayoutUpdatedOnce) {
         Q_FOREACH(int id, d->m_layoutUpdatedIds) {
@@ -69,6 +69,105 @@ public:
      */
     QString status() const;
 
+    /**
+     * Enables or disables snapshot mode. When enabled, the exporter keeps an
+     * immutable copy of the exported menu tree, updated every time pending
+     * changes are flushed, and answers the read-only DBus methods
+     * (GetLayout(), GetGroupProperties() and GetProperty()) from a dedicated
+     * thread, using this copy. This way menus can still be read by the other
+     * side while the application is busy.
+     *
+     * AboutToShow() and Event() are still processed in the GUI thread.
+     *
+     * Snapshot mode is disabled by default.
+     */
+    void setSnapshotEnabled(bool enabled);
+
+    /**
+     * Returns whether snapshot mode is enabled.
+     * @ref setSnapshotEnabled
+     */
+    bool isSnapshotEnabled() const;
+
+    /**
+     * Call this from a slot connected to the aboutToShow() signal of @p menu
+     * if the slot is going to populate the menu asynchronously. The DBus
+     * AboutToShow() call which caused the signal to be emitted is then not
+     * answered when the slot returns but when finishAboutToShow() is called,
+     * and the exporter keeps processing other requests meanwhile.
+     */
+    void deferAboutToShow(QMenu *menu);
+
+    /**
+     * Tells the exporter @p menu has been populated, after a call to
+     * deferAboutToShow().
+     */
+    void finishAboutToShow(QMenu *menu);
+
+    /**
+     * Sets the maximum time, in milliseconds, the other side waits for an
+     * answer to AboutToShow(). When a menu whose population has been deferred
+     * with deferAboutToShow() is not ready before this deadline, the exporter
+     * answers that nothing changed, so the other side shows the layout it
+     * already has, and emits a layout update once finishAboutToShow() is
+     * called. Handlers taking longer than this are reported through
+     * slowAboutToShow().
+     *
+     * Defaults to 0, which means there is no deadline.
+     */
+    void setAboutToShowTimeout(int msecs);
+
+    /**
+     * Returns the AboutToShow() deadline.
+     * @ref setAboutToShowTimeout
+     */
+    int aboutToShowTimeout() const;
+
+    /**
+     * Enables or disables peer-to-peer mode. When enabled, the exporter
+     * listens on a private socket, advertises the "peer-to-peer" extension
+     * and gives its address through the GetPeerAddress() DBus method. A
+     * DBusMenuImporter finding this address
+     * connects to it directly and stops going through the bus daemon, which
+     * reduces latency and daemon load for menus with a lot of traffic.
+     *
+     * Only processes running as the same user can connect to the socket.
+     *
+     * Peer-to-peer mode is disabled by default.
+     */
+    void setPeerToPeerEnabled(bool enabled);
+
+    /**
+     * Returns whether peer-to-peer mode is enabled.
+     * @ref setPeerToPeerEnabled
+     */
+    bool isPeerToPeerEnabled() const;
+
+    /**
+     * Enables or disables passing layouts as file descriptors. When enabled,
+     * a DBusMenuImporter asks for layouts with the GetLayoutFd() DBus method.
+     * Large layouts, with their icon data, are then written to a sealed
+     * memory file whose descriptor is sent instead of the data, so that they
+     * are not copied through the bus daemon. Small layouts, and layouts for
+     * connections which cannot pass file descriptors, are sent inline.
+     *
+     * File descriptor passing is disabled by default.
+     */
+    void setFileDescriptorPassingEnabled(bool enabled);
+
+    /**
+     * Returns whether layouts can be passed as file descriptors.
+     * @ref setFileDescriptorPassingEnabled
+     */
+    bool isFileDescriptorPassingEnabled() const;
+
+Q_SIGNALS:
+    /**
+     * Emitted when the aboutToShow() handler of @p menu took @p msecs
+     * milliseconds to complete, which is more than aboutToShowTimeout().
+     */
+    void slowAboutToShow(QMenu *menu, int msecs);
+
 protected:
     /**
      * Must extract the icon name for action. This is the name which will
@@ -82,6 +181,7 @@ private Q_SLOTS:
     void doUpdateActions();
     void doEmitLayoutUpdated();
     void slotActionDestroyed(QObject*);
+    void slotNewPeerConnection(const QDBusConnection &connection);
 
 private:
     Q_DISABLE_COPY(DBusMenuExporter)
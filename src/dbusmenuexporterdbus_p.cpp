@@ -21,23 +21,31 @@
 #include "dbusmenuexporterdbus_p.h"
 
 // Qt
+#include <QDBusError>
 #include <QDBusMessage>
+#include <QDBusServer>
 #include <QMenu>
+#include <QTimer>
 #include <QVariant>
 
 // Local
 #include "dbusmenuadaptor.h"
 #include "dbusmenuexporterprivate_p.h"
+#include "dbusmenupayload_p.h"
 #include "dbusmenushortcut_p.h"
+#include "dbusmenusnapshot_p.h"
 #include "debug_p.h"
 
 static const char *DBUSMENU_INTERFACE = "com.canonical.dbusmenu";
 static const char *FDO_PROPERTIES_INTERFACE = "org.freedesktop.DBus.Properties";
+static const char *ICON_DATA_HASH_PROPERTY = "x-qt-icon-data-hash";
 
 DBusMenuExporterDBus::DBusMenuExporterDBus(DBusMenuExporter *exporter)
 : QObject(exporter)
 , m_exporter(exporter)
 , m_status("normal")
+, m_aboutToShowTimeout(0)
+, m_layoutFdEnabled(false)
 {
     DBusMenuTypes_register();
     new DbusmenuAdaptor(this);
@@ -55,6 +63,20 @@ uint DBusMenuExporterDBus::GetLayout(int parentId, int recursionDepth, const QSt
     return m_exporter->d->m_revision;
 }
 
+uint DBusMenuExporterDBus::GetLayoutFd(int parentId, int recursionDepth, const QStringList &propertyNames, QDBusVariant &layout)
+{
+    if (!m_layoutFdEnabled) {
+        if (calledFromDBus()) {
+            sendErrorReply(QDBusError::NotSupported, "Passing layouts as file descriptors is not enabled");
+        }
+        return 0;
+    }
+    DBusMenuLayoutItem item;
+    uint revision = GetLayout(parentId, recursionDepth, propertyNames, item);
+    layout = DBusMenuPayload_fromLayout(item, calledFromDBus() ? connection() : m_exporter->d->connection());
+    return revision;
+}
+
 void DBusMenuExporterDBus::Event(int id, const QString &eventType, const QDBusVariant &/*data*/, uint /*timestamp*/)
 {
     if (eventType == "clicked") {
@@ -73,6 +95,22 @@ void DBusMenuExporterDBus::Event(int id, const QString &eventType, const QDBusVa
     }
 }
 
+QList<int> DBusMenuExporterDBus::EventGroup(const DBusMenuEventList &events)
+{
+    QList<int> idErrors;
+    Q_FOREACH(const DBusMenuEvent &event, events) {
+        if (event.id != 0 && !m_exporter->d->m_actionForId.contains(event.id)) {
+            idErrors << event.id;
+            continue;
+        }
+        Event(event.id, event.eventId, event.data, event.timestamp);
+    }
+    if (!events.isEmpty() && idErrors.count() == events.count() && calledFromDBus()) {
+        sendErrorReply(QDBusError::InvalidArgs, "None of the ids could be found");
+    }
+    return idErrors;
+}
+
 QDBusVariant DBusMenuExporterDBus::GetProperty(int id, const QString &name)
 {
     QAction *action = m_exporter->d->m_actionForId.value(id);
@@ -80,7 +118,7 @@ QDBusVariant DBusMenuExporterDBus::GetProperty(int id, const QString &name)
     return QDBusVariant(m_exporter->d->m_actionProperties.value(action).value(name));
 }
 
-QVariantMap DBusMenuExporterDBus::getProperties(int id, const QStringList &names) const
+QVariantMap DBusMenuExporterDBus::allProperties(int id) const
 {
     if (id == 0) {
         QVariantMap map;
@@ -89,8 +127,15 @@ QVariantMap DBusMenuExporterDBus::getProperties(int id, const QStringList &names
     }
     QAction *action = m_exporter->d->m_actionForId.value(id);
     DMRETURN_VALUE_IF_FAIL(action, QVariantMap());
-    QVariantMap all = m_exporter->d->m_actionProperties.value(action);
+    return m_exporter->d->m_actionProperties.value(action);
+}
+
+QVariantMap DBusMenuExporterDBus::getProperties(int id, const QStringList &names) const
+{
+    QVariantMap all = allProperties(id);
     if (names.isEmpty()) {
+        // The hash is only sent to clients asking for it
+        all.remove(ICON_DATA_HASH_PROPERTY);
         return all;
     } else {
         QVariantMap map;
@@ -148,13 +193,214 @@ protected:
 
 bool DBusMenuExporterDBus::AboutToShow(int id)
 {
+    bool changed = false;
+    if (calledFromDBus()) {
+        if (!processAboutToShow(id, message(), connection().name(), &changed)) {
+            setDelayedReply(true);
+        }
+    } else {
+        processAboutToShow(id, QDBusMessage(), QString(), &changed);
+    }
+    return changed;
+}
+
+bool DBusMenuExporterDBus::processAboutToShow(int id, const QDBusMessage &message, const QString &connectionName, bool *changed)
+{
+    *changed = false;
     QMenu *menu = m_exporter->d->menuForId(id);
-    DMRETURN_VALUE_IF_FAIL(menu, false);
+    DMRETURN_VALUE_IF_FAIL(menu, true);
+
+    PendingReply reply;
+    reply.message = message;
+    reply.connectionName = connectionName;
 
-    ActionEventFilter filter;
-    menu->installEventFilter(&filter);
+    QHash<QMenu *, PendingAboutToShow>::Iterator it = m_pendingAboutToShow.find(menu);
+    if (it != m_pendingAboutToShow.end()) {
+        if (it->timedOut) {
+            // Too late already, the other side keeps its current layout
+            return true;
+        }
+        // The menu is still being populated, answer when it is done
+        if (message.type() == QDBusMessage::MethodCallMessage) {
+            it->replies << reply;
+        }
+        return false;
+    }
+
+    QTime time;
+    time.start();
+    ActionEventFilter *filter = new ActionEventFilter;
+    menu->installEventFilter(filter);
     QMetaObject::invokeMethod(menu, "aboutToShow");
-    return filter.mChanged;
+
+    if (!m_deferredMenus.remove(menu)) {
+        *changed = filter->mChanged;
+        menu->removeEventFilter(filter);
+        delete filter;
+        // We cannot interrupt a synchronous handler, but we can report it
+        int elapsed = time.elapsed();
+        if (m_aboutToShowTimeout > 0 && elapsed > m_aboutToShowTimeout) {
+            m_exporter->slowAboutToShow(menu, elapsed);
+        }
+        return true;
+    }
+
+    PendingAboutToShow pending;
+    pending.id = id;
+    pending.filter = filter;
+    pending.time = time;
+    if (message.type() == QDBusMessage::MethodCallMessage) {
+        pending.replies << reply;
+    }
+    if (m_aboutToShowTimeout > 0) {
+        int remaining = qMax(m_aboutToShowTimeout - time.elapsed(), 0);
+        pending.deadlineTimer = new QTimer(this);
+        pending.deadlineTimer->setSingleShot(true);
+        connect(pending.deadlineTimer, SIGNAL(timeout()), SLOT(slotAboutToShowDeadline()));
+        pending.deadlineTimer->start(remaining);
+    }
+    m_pendingAboutToShow.insert(menu, pending);
+    connect(menu, SIGNAL(destroyed(QObject*)), SLOT(slotPendingMenuDestroyed(QObject*)));
+    return false;
+}
+
+void DBusMenuExporterDBus::completeAboutToShow(QMenu *menu)
+{
+    // The handler may call us before it returns
+    m_deferredMenus.remove(menu);
+
+    QHash<QMenu *, PendingAboutToShow>::Iterator it = m_pendingAboutToShow.find(menu);
+    if (it == m_pendingAboutToShow.end()) {
+        return;
+    }
+    PendingAboutToShow pending = *it;
+    m_pendingAboutToShow.erase(it);
+    disconnect(menu, SIGNAL(destroyed(QObject*)), this, SLOT(slotPendingMenuDestroyed(QObject*)));
+
+    bool changed = pending.filter->mChanged;
+    menu->removeEventFilter(pending.filter);
+    delete pending.filter;
+    delete pending.deadlineTimer;
+
+    int elapsed = pending.time.elapsed();
+    if (m_aboutToShowTimeout > 0 && elapsed > m_aboutToShowTimeout) {
+        m_exporter->slowAboutToShow(menu, elapsed);
+    }
+
+    if (changed && pending.layoutUpdateNeeded) {
+        // We told the other side nothing changed, tell it the truth now
+        m_exporter->d->emitLayoutUpdated(pending.id);
+    }
+    if (pending.timedOut) {
+        return;
+    }
+
+    if (changed) {
+        flushChanges();
+    }
+    Q_FOREACH(const PendingReply &reply, pending.replies) {
+        QDBusConnection(reply.connectionName).send(reply.message.createReply(changed));
+    }
+}
+
+void DBusMenuExporterDBus::slotAboutToShowDeadline()
+{
+    QHash<QMenu *, PendingAboutToShow>::Iterator
+        it = m_pendingAboutToShow.begin(),
+        end = m_pendingAboutToShow.end();
+    for (; it != end; ++it) {
+        if (it->deadlineTimer == sender()) {
+            break;
+        }
+    }
+    DMRETURN_IF_FAIL(it != end);
+
+    DMWARNING << "aboutToShow() handler of menu" << it->id << "did not finish before deadline, answering with current layout";
+    // The other side keeps the layout it already has
+    Q_FOREACH(const PendingReply &reply, it->replies) {
+        QDBusConnection(reply.connectionName).send(reply.message.createReply(false));
+    }
+    it->replies.clear();
+    it->timedOut = true;
+    it->layoutUpdateNeeded = true;
+    it->deadlineTimer->deleteLater();
+    it->deadlineTimer = 0;
+}
+
+void DBusMenuExporterDBus::slotPendingMenuDestroyed(QObject *object)
+{
+    // Do not dereference object, it is being destroyed
+    QMenu *menu = static_cast<QMenu *>(object);
+    m_deferredMenus.remove(menu);
+    PendingAboutToShow pending = m_pendingAboutToShow.take(menu);
+    delete pending.filter;
+    delete pending.deadlineTimer;
+    Q_FOREACH(const PendingReply &reply, pending.replies) {
+        QDBusConnection(reply.connectionName).send(reply.message.createReply(false));
+    }
+}
+
+QList<int> DBusMenuExporterDBus::AboutToShowGroup(const QList<int> &ids, QList<int> &idErrors)
+{
+    QList<int> updatesNeeded;
+    Q_FOREACH(int id, ids) {
+        QMenu *menu = m_exporter->d->menuForId(id);
+        if (!menu) {
+            idErrors << id;
+            continue;
+        }
+        bool changed;
+        if (!processAboutToShow(id, QDBusMessage(), QString(), &changed)) {
+            // Do not hold the whole group for one menu: answer "no change"
+            // for it and announce the new layout when it is ready
+            m_pendingAboutToShow[menu].layoutUpdateNeeded = true;
+            continue;
+        }
+        if (changed) {
+            updatesNeeded << id;
+        }
+    }
+    if (!updatesNeeded.isEmpty()) {
+        flushChanges();
+    }
+    if (!ids.isEmpty() && idErrors.count() == ids.count() && calledFromDBus()) {
+        sendErrorReply(QDBusError::InvalidArgs, "None of the ids could be found");
+    }
+    return updatesNeeded;
+}
+
+void DBusMenuExporterDBus::replyToAboutToShowGroup(const QList<int> &ids, const QDBusMessage &message, const QString &connectionName)
+{
+    QList<int> idErrors;
+    QList<int> updatesNeeded = AboutToShowGroup(ids, idErrors);
+    QDBusMessage reply;
+    if (!ids.isEmpty() && idErrors.count() == ids.count()) {
+        reply = message.createErrorReply(QDBusError::InvalidArgs, "None of the ids could be found");
+    } else {
+        reply = message.createReply(QVariantList()
+            << QVariant::fromValue(updatesNeeded)
+            << QVariant::fromValue(idErrors));
+    }
+    QDBusConnection(connectionName).send(reply);
+}
+
+void DBusMenuExporterDBus::flushChanges()
+{
+    // The caller is going to ask for the new layout right away, make sure
+    // the snapshot it will get it from is up to date
+    m_exporter->d->flushChangesToSnapshot();
+}
+
+void DBusMenuExporterDBus::replyToAboutToShow(int id, const QDBusMessage &message, const QString &connectionName)
+{
+    bool changed;
+    if (!processAboutToShow(id, message, connectionName, &changed)) {
+        return;
+    }
+    if (changed) {
+        flushChanges();
+    }
+    QDBusConnection(connectionName).send(message.createReply(changed));
 }
 
 void DBusMenuExporterDBus::setStatus(const QString& status)
@@ -163,6 +409,9 @@ void DBusMenuExporterDBus::setStatus(const QString& status)
         return;
     }
     m_status = status;
+    if (m_exporter->d->m_snapshotObject) {
+        m_exporter->d->m_snapshotObject->setStatus(status);
+    }
 
     QVariantMap map;
     map.insert("Status", QVariant(status));
@@ -174,7 +423,44 @@ void DBusMenuExporterDBus::setStatus(const QString& status)
         << QStringList() // New properties: none
         ;
     msg.setArguments(args);
-    QDBusConnection::sessionBus().send(msg);
+    Q_FOREACH(const QDBusConnection &connection, m_exporter->d->connections()) {
+        connection.send(msg);
+    }
+}
+
+QString DBusMenuExporterDBus::GetPeerAddress()
+{
+    QDBusServer *server = m_exporter->d->m_peerServer;
+    return server ? server->address() : QString();
+}
+
+QVariantMap DBusMenuExporterDBus::GetIcons(const QStringList &hashes)
+{
+    QSet<QString> wanted = hashes.toSet();
+    QVariantMap map;
+    Q_FOREACH(const QVariantMap &properties, m_exporter->d->m_actionProperties) {
+        QString hash = properties.value(ICON_DATA_HASH_PROPERTY).toString();
+        if (!hash.isEmpty() && wanted.remove(hash)) {
+            map.insert(hash, properties.value("icon-data"));
+            if (wanted.isEmpty()) {
+                break;
+            }
+        }
+    }
+    return map;
+}
+
+QStringList DBusMenuExporterDBus::qtExtensions() const
+{
+    QStringList list;
+    list << "icon-data-hash";
+    if (m_layoutFdEnabled) {
+        list << "layout-fd";
+    }
+    if (m_exporter->isPeerToPeerEnabled()) {
+        list << "peer-to-peer";
+    }
+    return list;
 }
 
 QString DBusMenuExporterDBus::status() const
@@ -25,11 +25,21 @@
 #include <dbusmenutypes_p.h>
 
 // Qt
+#include <QtCore/QHash>
 #include <QtCore/QObject>
+#include <QtCore/QSet>
+#include <QtCore/QTime>
 #include <QtCore/QVariant>
 #include <QtDBus/QDBusAbstractAdaptor>
+#include <QtDBus/QDBusContext>
+#include <QtDBus/QDBusMessage>
 #include <QtDBus/QDBusVariant>
 
+class QMenu;
+class QTimer;
+
+class ActionEventFilter;
+
 class DBusMenuExporter;
 
 /**
@@ -37,26 +47,49 @@ class DBusMenuExporter;
  * This avoid exposing the implementation of the DBusMenu spec to the outside
  * world.
  */
-class DBusMenuExporterDBus : public QObject
+class DBusMenuExporterDBus : public QObject, protected QDBusContext
 {
     Q_OBJECT
     Q_CLASSINFO("D-Bus Interface", "com.canonical.dbusmenu")
     Q_PROPERTY(uint Version READ Version)
     Q_PROPERTY(QString Status READ status)
+    Q_PROPERTY(QStringList QtExtensions READ qtExtensions)
 public:
     DBusMenuExporterDBus(DBusMenuExporter *m_exporter);
 
-    uint Version() const { return 2; }
+    uint Version() const { return 3; }
 
     QString status() const;
     void setStatus(const QString &status);
 
+    /**
+     * Extensions to the DBusMenu spec currently enabled
+     */
+    QStringList qtExtensions() const;
+
 public Q_SLOTS:
     Q_NOREPLY void Event(int id, const QString &eventId, const QDBusVariant &data, uint timestamp);
     QDBusVariant GetProperty(int id, const QString &property);
     uint GetLayout(int parentId, int recursionDepth, const QStringList &propertyNames, DBusMenuLayoutItem &item);
     DBusMenuItemList GetGroupProperties(const QList<int> &ids, const QStringList &propertyNames);
     bool AboutToShow(int id);
+    QList<int> EventGroup(const DBusMenuEventList &events);
+    QList<int> AboutToShowGroup(const QList<int> &ids, QList<int> &idErrors);
+    // Extension: address to connect to for a peer-to-peer connection, empty
+    // if peer-to-peer mode is disabled
+    QString GetPeerAddress();
+    // Extension: same as GetLayout() but the layout is serialized with
+    // DBusMenuTypes_writeLayout(), and passed as a file descriptor if large
+    uint GetLayoutFd(int parentId, int recursionDepth, const QStringList &propertyNames, QDBusVariant &layout);
+    // Extension: icon-data for each of the x-qt-icon-data-hash values in
+    // hashes. Unknown hashes are left out.
+    QVariantMap GetIcons(const QStringList &hashes);
+
+private Q_SLOTS:
+    void replyToAboutToShow(int id, const QDBusMessage &message, const QString &connectionName);
+    void replyToAboutToShowGroup(const QList<int> &ids, const QDBusMessage &message, const QString &connectionName);
+    void slotPendingMenuDestroyed(QObject *menu);
+    void slotAboutToShowDeadline();
 
 Q_SIGNALS:
     void ItemsPropertiesUpdated(DBusMenuItemList, DBusMenuItemKeysList);
@@ -64,13 +97,52 @@ Q_SIGNALS:
     void ItemActivationRequested(int id, uint timeStamp);
 
 private:
+    struct PendingReply
+    {
+        QDBusMessage message;
+        QString connectionName;
+    };
+
+    /**
+     * An AboutToShow() call whose menu is being populated asynchronously
+     */
+    struct PendingAboutToShow
+    {
+        PendingAboutToShow() : id(0), filter(0), deadlineTimer(0), timedOut(false), layoutUpdateNeeded(false) {}
+        int id;
+        ActionEventFilter *filter;
+        QList<PendingReply> replies;
+        QTime time;
+        QTimer *deadlineTimer;
+        // True if replies have been sent before the handler was done
+        bool timedOut;
+        // True if LayoutUpdated must be emitted once the handler is done
+        bool layoutUpdateNeeded;
+    };
+
     DBusMenuExporter *m_exporter;
     QString m_status;
+    int m_aboutToShowTimeout;
+    bool m_layoutFdEnabled;
+
+    // Menus whose aboutToShow() handler asked to answer later
+    QSet<QMenu *> m_deferredMenus;
+    QHash<QMenu *, PendingAboutToShow> m_pendingAboutToShow;
 
     friend class DBusMenuExporter;
     friend class DBusMenuExporterPrivate;
 
+    QVariantMap allProperties(int id) const;
     QVariantMap getProperties(int id, const QStringList &names) const;
+
+    /**
+     * Emits aboutToShow() for the menu of @p id. Returns false if the handler
+     * deferred its answer, in which case @p message will be answered by
+     * completeAboutToShow(). Otherwise sets @p changed and returns true.
+     */
+    bool processAboutToShow(int id, const QDBusMessage &message, const QString &connectionName, bool *changed);
+    void completeAboutToShow(QMenu *menu);
+    void flushChanges();
 };
 
 #endif /* DBUSMENUEXPORTERDBUS_P_H */
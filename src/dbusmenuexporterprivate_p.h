@@ -31,9 +31,13 @@
 #include <QtCore/QSet>
 #include <QtCore/QVariant>
 
+class QDBusServer;
 class QMenu;
+class QThread;
 
 class DBusMenuExporterDBus;
+class DBusMenuSnapshot;
+class DBusMenuSnapshotDBus;
 
 class DBusMenuExporterPrivate
 {
@@ -41,9 +45,16 @@ public:
     DBusMenuExporter *q;
 
     QString m_objectPath;
+    QString m_connectionName;
 
     DBusMenuExporterDBus *m_dbusObject;
 
+    QThread *m_snapshotThread;
+    DBusMenuSnapshotDBus *m_snapshotObject;
+
+    QDBusServer *m_peerServer;
+    QStringList m_peerConnectionNames;
+
     QMenu *m_rootMenu;
     QHash<QAction *, QVariantMap> m_actionProperties;
     QMap<int, QAction *> m_actionForId;
@@ -85,6 +96,33 @@ public:
     void insertIconProperty(QVariantMap* map, QAction *action) const;
 
     void collapseSeparators(QMenu*);
+
+    QDBusConnection connection() const;
+
+    /**
+     * Returns the bus connection followed by the connections of all the
+     * peers still connected
+     */
+    QList<QDBusConnection> connections();
+
+    /**
+     * Returns the object answering DBus calls: either m_dbusObject or
+     * m_snapshotObject
+     */
+    QObject *exportedObject() const;
+
+    void registerObject(QDBusConnection connection);
+
+    /**
+     * Publishes a new snapshot of the menu tree, if snapshot mode is enabled
+     */
+    void updateSnapshot();
+    /**
+     * Flushes pending property changes, then makes sure the snapshot matches
+     * the menu tree. The snapshot is only built once.
+     */
+    void flushChangesToSnapshot();
+    void fillSnapshotItem(DBusMenuSnapshot *snapshot, int id, QMenu *menu);
 };
 
 
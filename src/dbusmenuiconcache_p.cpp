@@ -0,0 +1,89 @@
+/* This file is part of the dbusmenu-qt library
+   Copyright 2010 Canonical
+   Author: Aurelien Gateau <aurelien.gateau@canonical.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License (LGPL) as published by the Free Software Foundation;
+   either version 2 of the License, or (at your option) any later
+   version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+#include "dbusmenuiconcache_p.h"
+
+// Qt
+#include <QPixmap>
+
+// Enough for a few thousand menu-sized icons
+static const int DEFAULT_MAX_SIZE = 4096;
+
+static int costForIcon(const QIcon &icon)
+{
+    int cost = 0;
+    Q_FOREACH(const QSize &size, icon.availableSizes()) {
+        cost += size.width() * size.height() * 4;
+    }
+    // In kilobytes, rounded up so that no icon is free
+    return qMax(1, (cost + 1023) / 1024);
+}
+
+DBusMenuIconCache *DBusMenuIconCache::instance()
+{
+    // Never deleted: icons must not be destroyed after the application
+    static DBusMenuIconCache *cache = new DBusMenuIconCache;
+    return cache;
+}
+
+DBusMenuIconCache::DBusMenuIconCache()
+: m_cache(DEFAULT_MAX_SIZE)
+, m_hitCount(0)
+, m_missCount(0)
+{
+}
+
+bool DBusMenuIconCache::find(const QString &dataHash, QIcon *icon)
+{
+    // QCache::object() marks the entry as recently used
+    QIcon *cached = m_cache.object(dataHash);
+    if (!cached) {
+        ++m_missCount;
+        return false;
+    }
+    ++m_hitCount;
+    *icon = *cached;
+    return true;
+}
+
+void DBusMenuIconCache::insert(const QString &dataHash, const QIcon &icon)
+{
+    m_cache.insert(dataHash, new QIcon(icon), costForIcon(icon));
+}
+
+void DBusMenuIconCache::setMaxSize(int kilobytes)
+{
+    m_cache.setMaxCost(kilobytes);
+}
+
+int DBusMenuIconCache::maxSize() const
+{
+    return m_cache.maxCost();
+}
+
+qint64 DBusMenuIconCache::hitCount() const
+{
+    return m_hitCount;
+}
+
+qint64 DBusMenuIconCache::missCount() const
+{
+    return m_missCount;
+}
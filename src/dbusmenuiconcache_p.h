@@ -0,0 +1,66 @@
+/* This file is part of the dbusmenu-qt library
+   Copyright 2010 Canonical
+   Author: Aurelien Gateau <aurelien.gateau@canonical.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License (LGPL) as published by the Free Software Foundation;
+   either version 2 of the License, or (at your option) any later
+   version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+#ifndef DBUSMENUICONCACHE_P_H
+#define DBUSMENUICONCACHE_P_H
+
+// Qt
+#include <QtCore/QCache>
+#include <QtCore/QString>
+#include <QtGui/QIcon>
+
+/**
+ * Least-recently-used cache of decoded icons, keyed by the hash of their
+ * data. It is shared by all the DBusMenuImporter instances of the process so
+ * that icons used by many menus, or many applications, are decoded once.
+ * Must only be used from the GUI thread.
+ * @internal
+ */
+class DBusMenuIconCache
+{
+public:
+    static DBusMenuIconCache *instance();
+
+    /**
+     * Sets icon to the icon of dataHash and returns true if it is in the
+     * cache. Updates the hit and miss counts.
+     */
+    bool find(const QString &dataHash, QIcon *icon);
+
+    void insert(const QString &dataHash, const QIcon &icon);
+
+    /**
+     * Maximum size of the cache, in kilobytes of decoded pixels
+     */
+    void setMaxSize(int kilobytes);
+    int maxSize() const;
+
+    qint64 hitCount() const;
+    qint64 missCount() const;
+
+private:
+    DBusMenuIconCache();
+
+    QCache<QString, QIcon> m_cache;
+    qint64 m_hitCount;
+    qint64 m_missCount;
+};
+
+#endif /* DBUSMENUICONCACHE_P_H */
@@ -0,0 +1,93 @@
+/* This file is part of the dbusmenu-qt library
+   Copyright 2010 Canonical
+   Author: Aurelien Gateau <aurelien.gateau@canonical.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License (LGPL) as published by the Free Software Foundation;
+   either version 2 of the License, or (at your option) any later
+   version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+#include "dbusmenuicondecoder_p.h"
+
+// Qt
+#include <QPixmap>
+#include <QRunnable>
+
+// Local
+#include "dbusmenuiconcache_p.h"
+#include "debug_p.h"
+
+class DecodeJob : public QRunnable
+{
+public:
+    DecodeJob(DBusMenuIconDecoder *decoder, const QString &dataHash, const QByteArray &data)
+    : m_decoder(decoder)
+    , m_dataHash(dataHash)
+    , m_data(data)
+    {}
+
+    void run()
+    {
+        // QImage, unlike QPixmap, can be used outside the GUI thread
+        QImage image;
+        image.loadFromData(m_data);
+        QMetaObject::invokeMethod(m_decoder, "slotImageDecoded", Qt::QueuedConnection,
+            Q_ARG(QString, m_dataHash), Q_ARG(QImage, image));
+    }
+
+private:
+    DBusMenuIconDecoder *m_decoder;
+    QString m_dataHash;
+    QByteArray m_data;
+};
+
+DBusMenuIconDecoder *DBusMenuIconDecoder::instance()
+{
+    // Never deleted, like DBusMenuIconCache
+    static DBusMenuIconDecoder *decoder = new DBusMenuIconDecoder;
+    return decoder;
+}
+
+DBusMenuIconDecoder::DBusMenuIconDecoder()
+{
+}
+
+void DBusMenuIconDecoder::decode(const QString &dataHash, const QByteArray &data)
+{
+    if (m_decodingHashes.contains(dataHash)) {
+        return;
+    }
+    m_decodingHashes << dataHash;
+    m_pool.start(new DecodeJob(this, dataHash, data));
+}
+
+bool DBusMenuIconDecoder::isDecoding(const QString &dataHash) const
+{
+    return m_decodingHashes.contains(dataHash);
+}
+
+void DBusMenuIconDecoder::slotImageDecoded(const QString &dataHash, const QImage &image)
+{
+    m_decodingHashes.remove(dataHash);
+    QIcon icon;
+    if (image.isNull()) {
+        DMWARNING << "Failed to decode icon data with hash" << dataHash;
+    } else {
+        icon = QIcon(QPixmap::fromImage(image));
+        DBusMenuIconCache::instance()->insert(dataHash, icon);
+    }
+    iconDecoded(dataHash, icon);
+}
+
+#include "dbusmenuicondecoder_p.moc"
@@ -0,0 +1,71 @@
+/* This file is part of the dbusmenu-qt library
+   Copyright 2010 Canonical
+   Author: Aurelien Gateau <aurelien.gateau@canonical.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License (LGPL) as published by the Free Software Foundation;
+   either version 2 of the License, or (at your option) any later
+   version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+#ifndef DBUSMENUICONDECODER_P_H
+#define DBUSMENUICONDECODER_P_H
+
+// Qt
+#include <QtCore/QObject>
+#include <QtCore/QSet>
+#include <QtCore/QThreadPool>
+#include <QtGui/QIcon>
+#include <QtGui/QImage>
+
+// Local
+#include <dbusmenu_export.h>
+
+/**
+ * Decodes icon data to images in worker threads, so that menus with many
+ * icons do not block the GUI thread. Decoded icons are added to
+ * DBusMenuIconCache, then announced with iconDecoded(). Shared by all the
+ * DBusMenuImporter instances of the process. Must only be used from the GUI
+ * thread.
+ * @internal
+ */
+class DBUSMENU_EXPORT DBusMenuIconDecoder : public QObject
+{
+    Q_OBJECT
+public:
+    static DBusMenuIconDecoder *instance();
+
+    /**
+     * Starts decoding data, unless dataHash is already being decoded
+     */
+    void decode(const QString &dataHash, const QByteArray &data);
+
+    bool isDecoding(const QString &dataHash) const;
+
+Q_SIGNALS:
+    /**
+     * Emitted in the GUI thread. icon is null if data could not be decoded.
+     */
+    void iconDecoded(const QString &dataHash, const QIcon &icon);
+
+private Q_SLOTS:
+    void slotImageDecoded(const QString &dataHash, const QImage &image);
+
+private:
+    DBusMenuIconDecoder();
+
+    QThreadPool m_pool;
+    QSet<QString> m_decodingHashes;
+};
+
+#endif /* DBUSMENUICONDECODER_P_H */
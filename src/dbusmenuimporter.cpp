@@ -22,13 +22,19 @@
 
 // Qt
 #include <QCoreApplication>
+#include <QDataStream>
 #include <QDBusConnection>
-#include <QDBusInterface>
+#include <QDBusError>
+#include <QDBusMessage>
+#include <QDBusPendingCall>
 #include <QDBusReply>
 #include <QDBusVariant>
+#include <QElapsedTimer>
+#include <QEventLoop>
 #include <QFont>
 #include <QMenu>
 #include <QPointer>
+#include <QSet>
 #include <QSignalMapper>
 #include <QTime>
 #include <QTimer>
@@ -36,8 +42,13 @@
 #include <QWidgetAction>
 
 // Local
+#include "dbusmenuiconcache_p.h"
+#include "dbusmenuicondecoder_p.h"
+#include "dbusmenulatencystats_p.h"
+#include "dbusmenupayload_p.h"
 #include "dbusmenutypes_p.h"
 #include "dbusmenushortcut_p.h"
+#include "dbusmenusignaldispatcher_p.h"
 #include "debug_p.h"
 #include "utils_p.h"
 
@@ -49,12 +60,114 @@ static QTime sChrono;
 
 static const char *DBUSMENU_INTERFACE = "com.canonical.dbusmenu";
 
+// First version of the protocol providing AboutToShowGroup() and EventGroup()
+static const uint GROUP_METHODS_VERSION = 3;
+
+// Timeouts used until enough latencies have been measured
 static const int ABOUT_TO_SHOW_TIMEOUT = 3000;
 static const int REFRESH_TIMEOUT = 4000;
+// Measured timeouts are this many times the 99th percentile of the latencies
+static const int TIMEOUT_FACTOR = 3;
+static const int MIN_LATENCY_SAMPLE_COUNT = 8;
+static const int DEFAULT_MINIMUM_TIMEOUT = 500;
+static const int DEFAULT_MAXIMUM_TIMEOUT = 10000;
+// Number of consecutive timeouts after which menus stop waiting for the
+// application, and interval between the checks which tell if it is back
+static const int UNRESPONSIVE_TIMEOUT_COUNT = 3;
+static const int PROBE_INTERVAL = 5000;
+// Maximum number of GetLayout() calls sent at the same time because of
+// LayoutUpdated signals
+static const int MAX_CONCURRENT_LAYOUT_UPDATES = 4;
+// Interval between the checks which tell if the peer-to-peer connection is
+// still alive
+static const int PEER_CHECK_INTERVAL = 1000;
 
 static const char *DBUSMENU_PROPERTY_ID = "_dbusmenu_id";
 static const char *DBUSMENU_PROPERTY_ICON_NAME = "_dbusmenu_icon_name";
 static const char *DBUSMENU_PROPERTY_ICON_DATA_HASH = "_dbusmenu_icon_data_hash";
+static const char *DBUSMENU_PROPERTY_GROUP_IDS = "_dbusmenu_group_ids";
+static const char *DBUSMENU_PROPERTY_ICON_HASHES = "_dbusmenu_icon_hashes";
+static const char *DBUSMENU_PROPERTY_DEPTH = "_dbusmenu_depth";
+static const char *DBUSMENU_PROPERTY_START_TIME = "_dbusmenu_start_time";
+static const char *DBUSMENU_PROPERTY_OUTDATED = "_dbusmenu_outdated";
+static const char *DBUSMENU_PROPERTY_SUPERSEDED = "_dbusmenu_superseded";
+static const char *DBUSMENU_PROPERTY_COMPLETES_SHOW = "_dbusmenu_completes_show";
+static const char *DBUSMENU_PROPERTY_NONBLOCKING = "_dbusmenu_nonblocking";
+static const char *DBUSMENU_PROPERTY_IMMUTABLE = "_dbusmenu_immutable";
+static const char *DBUSMENU_PROPERTY_KEYS = "_dbusmenu_keys";
+
+static const char *ICON_DATA_HASH_PROPERTY = "x-qt-icon-data-hash";
+
+// Properties requested from exporters supporting x-qt-icon-data-hash: we get
+// the hash instead of icon-data, and only fetch the icons we do not have
+static const char *LAYOUT_PROPERTY_NAMES[] = {
+    "type", "label", "enabled", "visible", "icon-name", "x-qt-icon-data-hash",
+    "toggle-type", "toggle-state", "shortcut", "children-display", "x-kde-title",
+    0
+};
+
+/**
+ * Sends calls to the exporter. Unlike QDBusInterface, it does not introspect
+ * the remote object, and unlike QDBusAbstractInterface, it does not look up
+ * the owner of the service: creating it never blocks.
+ */
+class DBusMenuInterface
+{
+public:
+    DBusMenuInterface(const QString &service, const QString &path, const QDBusConnection &connection)
+    : m_service(service)
+    , m_path(path)
+    , m_connection(connection)
+    {}
+
+    /**
+     * Calls method with the valid arguments among arg1 to arg4, like
+     * QDBusAbstractInterface::asyncCall()
+     */
+    QDBusPendingCall asyncCall(const QString &method,
+        const QVariant &arg1 = QVariant(), const QVariant &arg2 = QVariant(),
+        const QVariant &arg3 = QVariant(), const QVariant &arg4 = QVariant()) const
+    {
+        QVariantList arguments;
+        arguments << arg1 << arg2 << arg3 << arg4;
+        while (!arguments.isEmpty() && !arguments.last().isValid()) {
+            arguments.removeLast();
+        }
+        QDBusMessage message = QDBusMessage::createMethodCall(m_service, m_path, DBUSMENU_INTERFACE, method);
+        message.setArguments(arguments);
+        return m_connection.asyncCall(message);
+    }
+
+    QString service() const
+    {
+        return m_service;
+    }
+
+    QDBusConnection connection() const
+    {
+        return m_connection;
+    }
+
+private:
+    QString m_service;
+    QString m_path;
+    QDBusConnection m_connection;
+};
+
+/**
+ * Returns a string made of the properties which can only be set when an
+ * action is created: an existing action can only be reused for an item if
+ * they match.
+ */
+static QString immutableSignature(const QVariantMap &map)
+{
+    return (QStringList()
+        << map.value("type").toString()
+        << map.value("children-display").toString()
+        << map.value("toggle-type").toString()
+        << map.value("x-kde-title").toString()
+        ).join("|");
+}
 
 static QAction *createKdeTitle(QAction *action, QWidget *parent)
 {
@@ -72,12 +185,18 @@ static QAction *createKdeTitle(QAction *action, QWidget *parent)
     return titleAction;
 }
 
-class DBusMenuImporterPrivate
+class DBusMenuImporterPrivate : public DBusMenuSignalReceiver
 {
 public:
     DBusMenuImporter *q;
 
-    QDBusAbstractInterface *m_interface;
+    QString m_service;
+    QString m_path;
+    // Name of the peer-to-peer connection, empty if talking through the bus
+    QString m_peerConnectionName;
+    QTimer *m_peerCheckTimer;
+
+    DBusMenuInterface *m_interface;
     QMenu *m_menu;
     typedef QMap<int, QPointer<QAction> > ActionForId;
     ActionForId m_actionForId;
@@ -87,25 +206,341 @@ public:
     QSet<int> m_idsRefreshedByAboutToShow;
     QSet<int> m_pendingLayoutUpdates;
 
+    // Version of the protocol implemented by the exporter, 0 until known
+    uint m_remoteVersion;
+    // Whether the exporter provides GetLayoutFd()
+    bool m_layoutFdSupported;
+    // Whether the exporter provides x-qt-icon-data-hash and GetIcons()
+    bool m_iconDataHashSupported;
+
+    // Icons returned by DBusMenuImporter::iconForName(), valid for the icon
+    // theme m_iconThemeName
+    QHash<QString, QIcon> m_iconForName;
+    QString m_iconThemeName;
+    // When true, icon names are collected in m_actionsWaitingForIconName
+    // instead of being resolved one by one
+    bool m_batchIconNames;
+    QList<QPair<QPointer<QAction>, QString> > m_actionsWaitingForIconName;
+
+    // Actions waiting for an icon which is being fetched or decoded
+    QHash<QString, QList<QPointer<QAction> > > m_actionsWaitingForIcon;
+    // Hashes to fetch in the next GetIcons() call
+    QSet<QString> m_iconHashesToFetch;
+    QTimer *m_iconFetchTimer;
+    // Events waiting to be sent with EventGroup()
+    DBusMenuEventList m_pendingEvents;
+    QTimer *m_pendingEventsTimer;
+    // Submenus which already received an AboutToShow() through the
+    // AboutToShowGroup() call of their parent or a prefetch
+    QSet<int> m_idsPreparedByAboutToShowGroup;
+    // Calls started by the prefetch of a hovered submenu: AboutToShow()
+    // first, then GetLayout() if needed
+    QHash<int, QPointer<QDBusPendingCallWatcher> > m_prefetchWatchers;
+    // Latencies of the calls to AboutToShow() and GetLayout(), measured with
+    // m_clock, from which timeouts are derived
+    QElapsedTimer m_clock;
+    DBusMenuLatencyStats m_aboutToShowLatency;
+    DBusMenuLatencyStats m_refreshLatency;
+    int m_minimumTimeout;
+    int m_maximumTimeout;
+
+    // Layout revision of the last GetLayout() reply applied to each menu
+    QHash<int, uint> m_revisionForId;
+    // Last GetLayout() call sent for each menu
+    QHash<int, QPointer<QDBusPendingCallWatcher> > m_refreshWatchers;
+
+    // Circuit breaker state, see registerTimeout()
+    int m_consecutiveTimeoutCount;
+    bool m_responsive;
+    QTimer *m_probeTimer;
+    QPointer<QDBusPendingCallWatcher> m_probeWatcher;
+
+    // Incremented each time the exporter changes, so that waits started for
+    // the previous one can tell their calls are outdated
+    uint m_exporterGeneration;
+    // Event loops of the running waitForWatcher() calls
+    QList<QEventLoop *> m_waitLoops;
+
+    // Whether menus with content are shown without waiting for AboutToShow()
+    bool m_backgroundRevalidationEnabled;
+    // Number of submenu levels fetched along with a menu, -1 for all
+    int m_prefetchDepth;
+    // Submenus whose content has not been fetched yet
+    QSet<int> m_unfetchedMenuIds;
+
     bool m_mustEmitMenuUpdated;
 
     DBusMenuImporterType m_type;
 
+    /**
+     * Starts talking to the exporter at m_path of m_service
+     */
+    void connectToExporter()
+    {
+        setConnection(QDBusConnection::sessionBus(), m_service);
+        discoverExporter();
+    }
+
+    /**
+     * Finds out what the exporter supports and fetches its menu, through the
+     * connection set by setConnection()
+     */
+    void discoverExporter()
+    {
+        // Find out which methods and extensions the exporter supports
+        QDBusMessage message = QDBusMessage::createMethodCall(m_interface->service(), m_path, "org.freedesktop.DBus.Properties", "GetAll");
+        message << QString(DBUSMENU_INTERFACE);
+        QDBusPendingCall call = m_interface->connection().asyncCall(message);
+        QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(call, q);
+        QObject::connect(watcher, SIGNAL(finished(QDBusPendingCallWatcher*)),
+            q, SLOT(slotGetPropertiesFinished(QDBusPendingCallWatcher*)));
+
+        // Fetch the menu once back to the event loop, so that setPrefetchDepth()
+        // can be called first
+        QTimer::singleShot(0, q, SLOT(refreshRootMenu()));
+    }
+
+    /**
+     * Forgets everything about the current exporter: its menus, the calls
+     * sent to it and what we learnt about it
+     */
+    void resetExporterState()
+    {
+        // Stop waiting for the previous exporter
+        ++m_exporterGeneration;
+        quitWaitLoops();
+
+        // Replies to calls which are still running must be ignored
+        Q_FOREACH(QDBusPendingCallWatcher *watcher, q->findChildren<QDBusPendingCallWatcher *>()) {
+            QObject::disconnect(watcher, 0, q, 0);
+            watcher->deleteLater();
+        }
+
+        if (m_menu) {
+            deleteActions(m_menu->actions().toSet());
+        }
+        m_actionForId.clear();
+        m_unfetchedMenuIds.clear();
+        m_revisionForId.clear();
+        m_refreshWatchers.clear();
+        m_prefetchWatchers.clear();
+        m_idsRefreshedByAboutToShow.clear();
+        m_idsPreparedByAboutToShowGroup.clear();
+        m_pendingLayoutUpdates.clear();
+        m_pendingLayoutUpdateTimer->stop();
+
+        m_actionsWaitingForIcon.clear();
+        m_actionsWaitingForIconName.clear();
+        m_iconHashesToFetch.clear();
+        m_iconFetchTimer->stop();
+
+        m_remoteVersion = 0;
+        m_layoutFdSupported = false;
+        m_iconDataHashSupported = false;
+        m_aboutToShowLatency.clear();
+        m_refreshLatency.clear();
+        m_consecutiveTimeoutCount = 0;
+        setResponsive(true);
+        m_mustEmitMenuUpdated = false;
+    }
+
+    /**
+     * (Re)creates m_interface and the signal subscription to talk to the
+     * exporter through @p connection. @p service must be empty for
+     * peer-to-peer connections.
+     */
+    void setConnection(const QDBusConnection &connection, const QString &service)
+    {
+        disconnectSignals();
+        delete m_interface;
+        m_interface = new DBusMenuInterface(service, m_path, connection);
+        DBusMenuSignalDispatcher::instance(connection)->addReceiver(this, service, m_path);
+    }
+
+    /**
+     * Goes back to the bus if the peer-to-peer connection has been closed,
+     * for example because the exporter disabled peer-to-peer mode, then
+     * refreshes the menu
+     */
+    void checkPeerConnection()
+    {
+        if (m_peerConnectionName.isEmpty() || QDBusConnection(m_peerConnectionName).isConnected()) {
+            return;
+        }
+        QString name = m_peerConnectionName;
+        m_peerConnectionName.clear();
+        m_peerCheckTimer->stop();
+        connectToExporter();
+        QDBusConnection::disconnectFromPeer(name);
+    }
+
+    void disconnectSignals()
+    {
+        if (m_interface) {
+            DBusMenuSignalDispatcher::instance(m_interface->connection())->removeReceiver(this);
+        }
+    }
+
+    void handleSignal(const QDBusMessage &message)
+    {
+        const QVariantList arguments = message.arguments();
+        const QString member = message.member();
+        if (member == "LayoutUpdated" && message.signature() == "ui") {
+            q->slotLayoutUpdated(arguments.at(0).toUInt(), arguments.at(1).toInt());
+        } else if (member == "ItemsPropertiesUpdated" && message.signature() == "a(ia{sv})a(ias)") {
+            slotItemsPropertiesUpdated(
+                qdbus_cast<DBusMenuItemList>(arguments.at(0)),
+                qdbus_cast<DBusMenuItemKeysList>(arguments.at(1)));
+        } else if (member == "ItemActivationRequested" && message.signature() == "iu") {
+            q->slotItemActivationRequested(arguments.at(0).toInt(), arguments.at(1).toUInt());
+        }
+    }
+
+    /**
+     * The exporter restarted, or appeared after us: nothing we know about the
+     * previous owner of the service applies anymore, its layout revisions in
+     * particular
+     */
+    void handleOwnerChange(const QString &/*owner*/)
+    {
+        m_pendingEvents.clear();
+        m_pendingEventsTimer->stop();
+        resetExporterState();
+        discoverExporter();
+    }
+
+    /**
+     * Replies come from the current owner of the service, which is also the
+     * sender of the signals we want
+     */
+    void updateServiceOwner(const QDBusMessage &reply)
+    {
+        if (m_interface && !reply.service().isEmpty()) {
+            DBusMenuSignalDispatcher::instance(m_interface->connection())->setOwner(this, reply.service());
+        }
+    }
+
+    /**
+     * Requests the layout of the menu for id. Submenus are requested at the
+     * same time, up to m_prefetchDepth levels, so that filling a tree costs
+     * one round trip, however many submenus it has.
+     *
+     * If a request for id is already running and the menu did not change
+     * since it was sent, it is returned instead of sending a new one. If it
+     * did change, the running request is superseded: its reply is ignored.
+     */
     QDBusPendingCallWatcher *refresh(int id)
     {
+        QDBusPendingCallWatcher *running = m_refreshWatchers.value(id);
+        bool completesShow = false;
+        if (running && !running->isFinished()) {
+            if (!running->property(DBUSMENU_PROPERTY_OUTDATED).toBool()) {
+                return running;
+            }
+            running->setProperty(DBUSMENU_PROPERTY_SUPERSEDED, true);
+            completesShow = running->property(DBUSMENU_PROPERTY_COMPLETES_SHOW).toBool();
+        }
+
         #ifdef BENCHMARK
         DMDEBUG << "Starting refresh chrono for id" << id;
         sChrono.start();
         #endif
-        QDBusPendingCall call = m_interface->asyncCall("GetLayout", id, 1, QStringList());
+        const int depth = m_prefetchDepth < 0 ? -1 : m_prefetchDepth + 1;
+        QDBusPendingCall call = m_interface->asyncCall(
+            m_layoutFdSupported ? "GetLayoutFd" : "GetLayout", id, depth, layoutPropertyNames());
         QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(call, q);
         watcher->setProperty(DBUSMENU_PROPERTY_ID, id);
+        watcher->setProperty(DBUSMENU_PROPERTY_DEPTH, depth);
+        if (completesShow) {
+            watcher->setProperty(DBUSMENU_PROPERTY_COMPLETES_SHOW, true);
+        }
+        startLatencyMeasure(watcher);
         QObject::connect(watcher, SIGNAL(finished(QDBusPendingCallWatcher*)),
             q, SLOT(slotGetLayoutFinished(QDBusPendingCallWatcher*)));
+        m_refreshWatchers.insert(id, watcher);
 
         return watcher;
     }
 
+    /**
+     * Returns the id of the menu containing the item id, 0 for the root menu
+     * and -1 if id is unknown
+     */
+    int parentIdForId(int id) const
+    {
+        QAction *action = m_actionForId.value(id);
+        if (!action) {
+            return -1;
+        }
+        QMenu *parentMenu = qobject_cast<QMenu *>(action->parent());
+        if (!parentMenu || !parentMenu->menuAction()) {
+            return -1;
+        }
+        if (parentMenu == m_menu) {
+            return 0;
+        }
+        return parentMenu->menuAction()->property(DBUSMENU_PROPERTY_ID).toInt();
+    }
+
+    int runningRefreshCount() const
+    {
+        int count = 0;
+        Q_FOREACH(const QPointer<QDBusPendingCallWatcher> &watcher, m_refreshWatchers) {
+            if (watcher && !watcher->isFinished()) {
+                ++count;
+            }
+        }
+        return count;
+    }
+
+    /**
+     * Returns true if refreshing one of the pending ancestors of the menu
+     * for id is enough to refresh it: the reply for the ancestor must
+     * contain the menu, given the prefetch depth
+     */
+    bool hasPendingAncestor(int id) const
+    {
+        int distance = 0;
+        for (int parentId = parentIdForId(id); parentId != -1;
+            parentId = parentId == 0 ? -1 : parentIdForId(parentId))
+        {
+            ++distance;
+            if (m_prefetchDepth >= 0 && distance > m_prefetchDepth) {
+                return false;
+            }
+            if (m_pendingLayoutUpdates.contains(parentId)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Called when the layout of the menu for id changed: running requests
+     * for this menu or its ancestors will return outdated content
+     */
+    void markRefreshesOutdated(int id)
+    {
+        for (; id != -1; id = id == 0 ? -1 : parentIdForId(id)) {
+            QDBusPendingCallWatcher *running = m_refreshWatchers.value(id);
+            if (running && !running->isFinished()) {
+                running->setProperty(DBUSMENU_PROPERTY_OUTDATED, true);
+            }
+        }
+    }
+
+    QStringList layoutPropertyNames() const
+    {
+        QStringList names;
+        if (m_iconDataHashSupported) {
+            for (const char **name = LAYOUT_PROPERTY_NAMES; *name; ++name) {
+                names << QString::fromLatin1(*name);
+            }
+        }
+        // An empty list means all properties
+        return names;
+    }
+
     QMenu *createMenu(QWidget *parent)
     {
         QMenu *menu = q->createMenu(parent);
@@ -113,9 +548,104 @@ public:
             q, SLOT(slotMenuAboutToShow()));
         QObject::connect(menu, SIGNAL(aboutToHide()),
             q, SLOT(slotMenuAboutToHide()));
+        QObject::connect(menu, SIGNAL(hovered(QAction*)),
+            q, SLOT(slotActionHovered(QAction*)));
         return menu;
     }
 
+    /**
+     * Called when an action is highlighted, with the mouse or the keyboard.
+     * If it has a submenu, it is likely to be shown soon: send AboutToShow()
+     * now so that the submenu is ready by then.
+     */
+    void slotActionHovered(QAction *action)
+    {
+        if (!action->menu()) {
+            return;
+        }
+        int id = action->property(DBUSMENU_PROPERTY_ID).toInt();
+        if (m_idsPreparedByAboutToShowGroup.contains(id) || isPrefetching(id)) {
+            return;
+        }
+        QDBusPendingCall call = m_interface->asyncCall("AboutToShow", id);
+        QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(call, q);
+        watcher->setProperty(DBUSMENU_PROPERTY_ID, id);
+        startLatencyMeasure(watcher);
+        QObject::connect(watcher, SIGNAL(finished(QDBusPendingCallWatcher*)),
+            q, SLOT(slotPrefetchFinished(QDBusPendingCallWatcher*)));
+        m_prefetchWatchers.insert(id, watcher);
+    }
+
+    void slotPrefetchFinished(QDBusPendingCallWatcher *watcher)
+    {
+        // Can be called directly by waitForPrefetch(), make sure it is not
+        // called a second time by the finished() signal
+        QObject::disconnect(watcher, 0, q, 0);
+        int id = watcher->property(DBUSMENU_PROPERTY_ID).toInt();
+        watcher->deleteLater();
+        measureReply(&m_aboutToShowLatency, watcher);
+        m_prefetchWatchers.remove(id);
+
+        QDBusPendingReply<bool> reply = *watcher;
+        if (reply.isError()) {
+            DMWARNING << "Call to AboutToShow() failed:" << reply.error().message();
+            return;
+        }
+        QMenu *menu = menuForId(id);
+        if (!menu) {
+            return;
+        }
+        m_idsPreparedByAboutToShowGroup << id;
+        if (reply.argumentAt<0>()) {
+            markRefreshesOutdated(id);
+        }
+        if (reply.argumentAt<0>() || menu->actions().isEmpty() || m_unfetchedMenuIds.contains(id)) {
+            m_idsRefreshedByAboutToShow << id;
+            m_prefetchWatchers.insert(id, refresh(id));
+        }
+    }
+
+    bool isPrefetching(int id) const
+    {
+        QDBusPendingCallWatcher *watcher = m_prefetchWatchers.value(id);
+        return watcher && !watcher->isFinished();
+    }
+
+    /**
+     * If the menu for id is being prefetched, waits for the prefetch to be
+     * over. Returns false if the importer has been deleted or the exporter
+     * has changed meanwhile.
+     */
+    bool waitForPrefetch(int id)
+    {
+        QPointer<DBusMenuImporter> guard(q);
+        const uint generation = m_exporterGeneration;
+        QPointer<QDBusPendingCallWatcher> watcher = m_prefetchWatchers.value(id);
+        if (!watcher || watcher->property(DBUSMENU_PROPERTY_DEPTH).isValid()) {
+            // Not prefetching or already waiting for the layout
+        } else {
+            if (!waitForWatcher(watcher, aboutToShowTimeout())) {
+                if (!guard || generation != m_exporterGeneration) {
+                    return false;
+                }
+                DMWARNING << "Application did not answer to AboutToShow() before timeout";
+            }
+            if (watcher && watcher->isFinished()) {
+                slotPrefetchFinished(watcher);
+            }
+            watcher = m_prefetchWatchers.value(id);
+        }
+        if (watcher && !watcher->isFinished()) {
+            if (!waitForWatcher(watcher, refreshTimeout())) {
+                if (!guard || generation != m_exporterGeneration) {
+                    return false;
+                }
+                DMWARNING << "Application did not refresh before timeout";
+            }
+        }
+        return true;
+    }
+
     /**
      * Init all the immutable action properties here
      * TODO: Document immutable properties?
@@ -153,12 +683,70 @@ public:
         updateAction(action, map, map.keys());
 
         if (isKdeTitle) {
-            action = createKdeTitle(action, parent);
+            // Titles are never reused, they do not get the properties below
+            return createKdeTitle(action, parent);
         }
 
+        action->setProperty(DBUSMENU_PROPERTY_IMMUTABLE, immutableSignature(_map));
+        action->setProperty(DBUSMENU_PROPERTY_KEYS, QStringList(map.keys()));
         return action;
     }
 
+    /**
+     * Returns whether action, created by createAction(), can represent an
+     * item with the properties in map
+     */
+    static bool canReuseAction(QAction *action, const QVariantMap &map)
+    {
+        QVariant signature = action->property(DBUSMENU_PROPERTY_IMMUTABLE);
+        return signature.isValid() && signature.toString() == immutableSignature(map);
+    }
+
+    /**
+     * Applies map to an action created by createAction(). Properties which
+     * the action had but which are not in map get back their default value.
+     */
+    void reuseAction(QAction *action, const QVariantMap &_map)
+    {
+        QVariantMap map = _map;
+        map.remove("type");
+        map.remove("children-display");
+        map.remove("toggle-type");
+        map.remove("x-kde-title");
+
+        QStringList keys = map.keys();
+        Q_FOREACH(const QString &key, action->property(DBUSMENU_PROPERTY_KEYS).toStringList()) {
+            if (!map.contains(key)) {
+                keys << key;
+            }
+        }
+        updateAction(action, map, keys);
+        action->setProperty(DBUSMENU_PROPERTY_KEYS, QStringList(map.keys()));
+    }
+
+    /**
+     * Deletes actions, and their submenus, and forgets about them
+     */
+    void deleteActions(const QSet<QAction *> &actions)
+    {
+        ActionForId::Iterator it = m_actionForId.begin();
+        while (it != m_actionForId.end()) {
+            if (actions.contains(*it)) {
+                m_unfetchedMenuIds.remove(it.key());
+                m_revisionForId.remove(it.key());
+                it = m_actionForId.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        Q_FOREACH(QAction *action, actions) {
+            if (action->menu()) {
+                action->menu()->deleteLater();
+            }
+            delete action;
+        }
+    }
+
     /**
      * Update mutable properties of an action. A property may be listed in
      * requestedProperties but not in map, this means we should use the default value
@@ -187,6 +775,8 @@ public:
             updateActionIconByName(action, value);
         } else if (key == "icon-data") {
             updateActionIconByData(action, value);
+        } else if (key == ICON_DATA_HASH_PROPERTY) {
+            updateActionIconByHash(action, value);
         } else if (key == "visible") {
             updateActionVisible(action, value);
         } else if (key == "shortcut") {
@@ -227,96 +817,538 @@ public:
             action->setIcon(QIcon());
             return;
         }
-        action->setIcon(q->iconForName(iconName));
+        if (m_batchIconNames) {
+            m_actionsWaitingForIconName << qMakePair(QPointer<QAction>(action), iconName);
+            return;
+        }
+        action->setIcon(iconForName(iconName));
+    }
+
+    /**
+     * Returns the icon for name, calling DBusMenuImporter::iconForName() only
+     * if it is not in the cache
+     */
+    QIcon iconForName(const QString &name)
+    {
+        checkIconTheme();
+        QHash<QString, QIcon>::ConstIterator it = m_iconForName.constFind(name);
+        if (it != m_iconForName.constEnd()) {
+            return *it;
+        }
+        QIcon icon = q->iconForName(name);
+        m_iconForName.insert(name, icon);
+        return icon;
+    }
+
+    /**
+     * Empties the icon name cache and reloads named icons if the icon theme
+     * changed since the cache was filled
+     */
+    void checkIconTheme()
+    {
+        QString themeName = QIcon::themeName();
+        if (themeName == m_iconThemeName) {
+            return;
+        }
+        m_iconThemeName = themeName;
+        if (m_iconForName.isEmpty()) {
+            return;
+        }
+        m_iconForName.clear();
+        Q_FOREACH(QAction *action, m_actionForId) {
+            if (!action) {
+                continue;
+            }
+            QString iconName = action->property(DBUSMENU_PROPERTY_ICON_NAME).toString();
+            if (!iconName.isEmpty()) {
+                action->setIcon(iconForName(iconName));
+            }
+        }
+    }
+
+    /**
+     * Sets the icons of the actions collected while m_batchIconNames was
+     * true. Names which are not in the cache are resolved with one call to
+     * the iconsForNames() method of the importer if it has one.
+     */
+    void resolvePendingIconNames()
+    {
+        m_batchIconNames = false;
+        if (m_actionsWaitingForIconName.isEmpty()) {
+            return;
+        }
+        checkIconTheme();
+
+        if (q->metaObject()->indexOfMethod("iconsForNames(QStringList)") != -1) {
+            QStringList names;
+            typedef QPair<QPointer<QAction>, QString> ActionAndName;
+            Q_FOREACH(const ActionAndName &pair, m_actionsWaitingForIconName) {
+                if (!m_iconForName.contains(pair.second) && !names.contains(pair.second)) {
+                    names << pair.second;
+                }
+            }
+            if (!names.isEmpty()) {
+                QVariantMap icons;
+                QMetaObject::invokeMethod(q, "iconsForNames", Qt::DirectConnection,
+                    Q_RETURN_ARG(QVariantMap, icons), Q_ARG(QStringList, names));
+                Q_FOREACH(const QString &name, names) {
+                    m_iconForName.insert(name, icons.value(name).value<QIcon>());
+                }
+            }
+        }
+
+        QList<QPair<QPointer<QAction>, QString> > list = m_actionsWaitingForIconName;
+        m_actionsWaitingForIconName.clear();
+        for (int pos = 0; pos < list.count(); ++pos) {
+            QAction *action = list.at(pos).first;
+            if (action) {
+                action->setIcon(iconForName(list.at(pos).second));
+            }
+        }
+    }
+
+    void updateActionIconByData(QAction *action, const QVariant &value)
+    {
+        QByteArray data = value.toByteArray();
+        QString dataHash = data.isEmpty() ? QString() : iconDataHash(data);
+        if (!setActionIconDataHash(action, dataHash)) {
+            return;
+        }
+        if (waitForIcon(action, dataHash)) {
+            return;
+        }
+        // Decoding happens in a worker thread, the action keeps its current
+        // icon until it is done
+        DBusMenuIconDecoder::instance()->decode(dataHash, data);
+    }
+
+    void updateActionIconByHash(QAction *action, const QVariant &value)
+    {
+        QString dataHash = value.toString();
+        if (!setActionIconDataHash(action, dataHash)) {
+            return;
+        }
+        if (waitForIcon(action, dataHash)) {
+            return;
+        }
+        // Keep the current icon until the new one arrives
+        m_iconHashesToFetch << dataHash;
+        if (!m_iconFetchTimer->isActive()) {
+            m_iconFetchTimer->start();
+        }
+    }
+
+    /**
+     * Sets the icon of action if it is in the cache. Otherwise adds action to
+     * the actions waiting for the icon and returns whether the icon is already
+     * being fetched or decoded.
+     */
+    bool waitForIcon(QAction *action, const QString &dataHash)
+    {
+        bool inProgress = m_actionsWaitingForIcon.contains(dataHash)
+            || DBusMenuIconDecoder::instance()->isDecoding(dataHash);
+        if (!inProgress) {
+            QIcon icon;
+            if (DBusMenuIconCache::instance()->find(dataHash, &icon)) {
+                action->setIcon(icon);
+                return true;
+            }
+        }
+        m_actionsWaitingForIcon[dataHash] << action;
+        return inProgress;
+    }
+
+    void slotIconDecoded(const QString &dataHash, const QIcon &icon)
+    {
+        QList<QPointer<QAction> > actions = m_actionsWaitingForIcon.take(dataHash);
+        Q_FOREACH(const QPointer<QAction> &action, actions) {
+            // The action may have been deleted, or got another icon meanwhile
+            if (action && action->property(DBUSMENU_PROPERTY_ICON_DATA_HASH).toString() == dataHash) {
+                action->setIcon(icon);
+            }
+        }
+    }
+
+    /**
+     * Stores the hash of the icon data of action. Returns false if it did not
+     * change. An empty hash removes the icon.
+     */
+    bool setActionIconDataHash(QAction *action, const QString &dataHash)
+    {
+        QString previousDataHash = action->property(DBUSMENU_PROPERTY_ICON_DATA_HASH).toString();
+        if (previousDataHash == dataHash) {
+            return false;
+        }
+        action->setProperty(DBUSMENU_PROPERTY_ICON_DATA_HASH, dataHash);
+        if (dataHash.isEmpty()) {
+            action->setIcon(QIcon());
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Fetches the icons of m_iconHashesToFetch in one GetIcons() call
+     */
+    void fetchPendingIcons()
+    {
+        if (m_iconHashesToFetch.isEmpty()) {
+            return;
+        }
+        QStringList hashes = m_iconHashesToFetch.toList();
+        m_iconHashesToFetch.clear();
+        QDBusPendingCall call = m_interface->asyncCall("GetIcons", hashes);
+        QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(call, q);
+        watcher->setProperty(DBUSMENU_PROPERTY_ICON_HASHES, hashes);
+        QObject::connect(watcher, SIGNAL(finished(QDBusPendingCallWatcher*)),
+            q, SLOT(slotGetIconsFinished(QDBusPendingCallWatcher*)));
+    }
+
+    void updateActionVisible(QAction *action, const QVariant &value)
+    {
+        action->setVisible(value.isValid() ? value.toBool() : true);
+    }
+
+    void updateActionShortcut(QAction *action, const QVariant &value)
+    {
+        DBusMenuShortcut dmShortcut;
+        if (value.userType() == qMetaTypeId<DBusMenuShortcut>()) {
+            // Comes from a layout stream
+            dmShortcut = value.value<DBusMenuShortcut>();
+        } else {
+            QDBusArgument arg = value.value<QDBusArgument>();
+            arg >> dmShortcut;
+        }
+        QKeySequence keySequence = dmShortcut.toKeySequence();
+        action->setShortcut(keySequence);
+    }
+
+    QMenu *menuForId(int id) const
+    {
+        if (id == 0) {
+            return q->menu();
+        }
+        QAction *action = m_actionForId.value(id);
+        if (!action) {
+            return 0;
+        }
+        return action->menu();
+    }
+
+    void slotItemsPropertiesUpdated(const DBusMenuItemList &updatedList, const DBusMenuItemKeysList &removedList);
+
+    void sendEvent(int id, const QString &eventId)
+    {
+        QDBusVariant empty(QString());
+        if (m_remoteVersion < GROUP_METHODS_VERSION) {
+            m_interface->asyncCall("Event", id, eventId, QVariant::fromValue(empty), 0u);
+            return;
+        }
+        // Queue the event: all the events sent during this iteration of the
+        // event loop will go in one EventGroup() call
+        DBusMenuEvent event;
+        event.id = id;
+        event.eventId = eventId;
+        event.data = empty;
+        event.timestamp = 0;
+        m_pendingEvents << event;
+        if (!m_pendingEventsTimer->isActive()) {
+            m_pendingEventsTimer->start();
+        }
+    }
+
+    void refreshRootMenu()
+    {
+        refresh(0);
+    }
+
+    void sendPendingEvents()
+    {
+        if (m_pendingEvents.isEmpty()) {
+            return;
+        }
+        m_interface->asyncCall("EventGroup", QVariant::fromValue(m_pendingEvents));
+        m_pendingEvents.clear();
+    }
+
+    /**
+     * Returns whether showing menu must not wait for the application: either
+     * in NONBLOCKING mode, or when the menu has content which can be shown
+     * while it is being revalidated
+     */
+    bool showsWithoutWaiting(QMenu *menu, int id) const
+    {
+        if (m_type == NONBLOCKING || !m_responsive) {
+            return true;
+        }
+        return m_backgroundRevalidationEnabled
+            && !menu->actions().isEmpty()
+            && !m_unfetchedMenuIds.contains(id);
+    }
+
+    /**
+     * Refreshes the menus of ids, waiting until they are all up to date
+     * unless nonBlocking is true
+     */
+    void refreshAfterAboutToShow(const QList<int> &ids, bool nonBlocking)
+    {
+        QList<QDBusPendingCallWatcher *> watchers;
+        Q_FOREACH(int id, ids) {
+            m_idsRefreshedByAboutToShow << id;
+            watchers << refresh(id);
+        }
+        if (nonBlocking) {
+            Q_FOREACH(QDBusPendingCallWatcher *watcher, watchers) {
+                watcher->setProperty(DBUSMENU_PROPERTY_COMPLETES_SHOW, true);
+            }
+            return;
+        }
+
+        // The calls run in parallel and are waited for together, so this
+        // costs no more than waiting for the slowest one
+        QPointer<DBusMenuImporter> guard(q);
+        const uint generation = m_exporterGeneration;
+        if (!waitForWatchers(watchers, refreshTimeout())) {
+            if (!guard || generation != m_exporterGeneration) {
+                return;
+            }
+            DMWARNING << "Application did not refresh before timeout";
+        }
+    }
+
+    void startLatencyMeasure(QDBusPendingCallWatcher *watcher)
+    {
+        watcher->setProperty(DBUSMENU_PROPERTY_START_TIME, m_clock.elapsed());
+    }
+
+    /**
+     * Called for each reply to AboutToShow() or GetLayout(): adds its latency
+     * to stats and tells whether the application is responsive
+     */
+    void measureReply(DBusMenuLatencyStats *stats, QDBusPendingCallWatcher *watcher)
+    {
+        if (watcher->isError()) {
+            QDBusError::ErrorType type = watcher->error().type();
+            if (type == QDBusError::Disconnected) {
+                // Do not wait for the next check to leave a closed
+                // peer-to-peer connection
+                QMetaObject::invokeMethod(q, "checkPeerConnection", Qt::QueuedConnection);
+            } else if (type != QDBusError::NoReply && type != QDBusError::Timeout) {
+                registerAnswer();
+            }
+            // Errors do not tell how fast the application is
+            return;
+        }
+        registerAnswer();
+        updateServiceOwner(watcher->reply());
+        QVariant startTime = watcher->property(DBUSMENU_PROPERTY_START_TIME);
+        if (startTime.isValid()) {
+            stats->addSample(int(m_clock.elapsed() - startTime.toLongLong()));
+        }
+    }
+
+    /**
+     * Circuit breaker: after UNRESPONSIVE_TIMEOUT_COUNT consecutive timeouts,
+     * the application is considered unresponsive and menus are shown without
+     * waiting for it, until it answers again.
+     */
+    void registerTimeout()
+    {
+        if (++m_consecutiveTimeoutCount >= UNRESPONSIVE_TIMEOUT_COUNT) {
+            setResponsive(false);
+        }
+    }
+
+    void registerAnswer()
+    {
+        m_consecutiveTimeoutCount = 0;
+        setResponsive(true);
+    }
+
+    void setResponsive(bool responsive)
+    {
+        if (m_responsive == responsive) {
+            return;
+        }
+        m_responsive = responsive;
+        if (responsive) {
+            m_probeTimer->stop();
+        } else {
+            DMWARNING << "Application is not responsive, menus will not wait for it anymore";
+            m_probeTimer->start();
+        }
+        q->responsivenessChanged(responsive);
+    }
+
+    /**
+     * Sends a call which is answered by the GUI thread of the application,
+     * to find out if it is responsive again
+     */
+    void probeExporter()
+    {
+        if (m_probeWatcher) {
+            return;
+        }
+        QDBusMessage message;
+        if (m_remoteVersion >= GROUP_METHODS_VERSION) {
+            // An empty AboutToShowGroup() has no effect. It goes through
+            // the GUI thread even in snapshot mode, where reading a
+            // property does not.
+            message = QDBusMessage::createMethodCall(m_interface->service(), m_path, DBUSMENU_INTERFACE, "AboutToShowGroup");
+            message << QVariant::fromValue(QList<int>());
+        } else {
+            // Older exporters have no snapshot mode
+            message = QDBusMessage::createMethodCall(m_interface->service(), m_path, "org.freedesktop.DBus.Properties", "Get");
+            message << QString(DBUSMENU_INTERFACE) << QString("Version");
+        }
+        QDBusPendingCall call = m_interface->connection().asyncCall(message, PROBE_INTERVAL);
+        m_probeWatcher = new QDBusPendingCallWatcher(call, q);
+        QObject::connect(m_probeWatcher, SIGNAL(finished(QDBusPendingCallWatcher*)),
+            q, SLOT(slotProbeFinished(QDBusPendingCallWatcher*)));
     }
 
-    void updateActionIconByData(QAction *action, const QVariant &value)
+    void slotProbeFinished(QDBusPendingCallWatcher *watcher)
     {
-        QByteArray data = value.toByteArray();
-        uint dataHash = qHash(data);
-        uint previousDataHash = action->property(DBUSMENU_PROPERTY_ICON_DATA_HASH).toUInt();
-        if (previousDataHash == dataHash) {
-            return;
+        watcher->deleteLater();
+        QDBusError::ErrorType type = watcher->isError() ? watcher->error().type() : QDBusError::NoError;
+        if (type != QDBusError::NoReply && type != QDBusError::Timeout) {
+            registerAnswer();
         }
-        action->setProperty(DBUSMENU_PROPERTY_ICON_DATA_HASH, dataHash);
-        QPixmap pix;
-        if (!pix.loadFromData(data)) {
-            DMWARNING << "Failed to decode icon-data property for action" << action->text();
-            action->setIcon(QIcon());
-            return;
+    }
+
+    /**
+     * Returns how long to wait for a call, based on the latencies measured
+     * for this kind of call and bounded by m_minimumTimeout and
+     * m_maximumTimeout
+     */
+    int timeout(const DBusMenuLatencyStats &stats, int defaultTimeout) const
+    {
+        int value = defaultTimeout;
+        if (stats.sampleCount() >= MIN_LATENCY_SAMPLE_COUNT) {
+            value = stats.percentile(99) * TIMEOUT_FACTOR;
         }
-        action->setIcon(QIcon(pix));
+        return qBound(m_minimumTimeout, value, m_maximumTimeout);
     }
 
-    void updateActionVisible(QAction *action, const QVariant &value)
+    int aboutToShowTimeout() const
     {
-        action->setVisible(value.isValid() ? value.toBool() : true);
+        return timeout(m_aboutToShowLatency, ABOUT_TO_SHOW_TIMEOUT);
     }
 
-    void updateActionShortcut(QAction *action, const QVariant &value)
+    int refreshTimeout() const
     {
-        QDBusArgument arg = value.value<QDBusArgument>();
-        DBusMenuShortcut dmShortcut;
-        arg >> dmShortcut;
-        QKeySequence keySequence = dmShortcut.toKeySequence();
-        action->setShortcut(keySequence);
+        return timeout(m_refreshLatency, REFRESH_TIMEOUT);
     }
 
-    QMenu *menuForId(int id) const
+    /**
+     * When the root menu is shown without waiting, menuUpdated() is emitted
+     * once it is up to date instead of when it is shown
+     */
+    void emitMenuUpdatedIfNeeded(int id, bool nonBlocking)
     {
-        if (id == 0) {
-            return q->menu();
+        if (id == 0 && nonBlocking && m_mustEmitMenuUpdated) {
+            m_mustEmitMenuUpdated = false;
+            q->menuUpdated();
         }
-        QAction *action = m_actionForId.value(id);
-        if (!action) {
-            return 0;
+    }
+
+    void quitWaitLoops()
+    {
+        Q_FOREACH(QEventLoop *loop, m_waitLoops) {
+            loop->quit();
         }
-        return action->menu();
     }
 
-    void slotItemsPropertiesUpdated(const DBusMenuItemList &updatedList, const DBusMenuItemKeysList &removedList);
+    bool waitForWatcher(QDBusPendingCallWatcher *watcher, int maxWait)
+    {
+        return waitForWatchers(QList<QDBusPendingCallWatcher *>() << watcher, maxWait);
+    }
 
-    void sendEvent(int id, const QString &eventId)
+    static bool hasUnfinishedWatcher(const QList<QPointer<QDBusPendingCallWatcher> > &watchers)
     {
-        QVariant empty = QVariant::fromValue(QDBusVariant(QString()));
-        m_interface->asyncCall("Event", id, eventId, empty, 0u);
+        Q_FOREACH(const QPointer<QDBusPendingCallWatcher> &watcher, watchers) {
+            if (watcher && !watcher->isFinished()) {
+                return true;
+            }
+        }
+        return false;
     }
 
-    bool waitForWatcher(QDBusPendingCallWatcher * _watcher, int maxWait)
+    /**
+     * Waits for all the watchers to finish, for at most maxWait milliseconds
+     * in total. Returns false if a call failed or timed out, if the importer
+     * got deleted, or if the exporter changed meanwhile.
+     *
+     * Watchers can finish in any order, and be deleted once their reply has
+     * been handled: deleted watchers count as finished.
+     */
+    bool waitForWatchers(const QList<QDBusPendingCallWatcher *> &_watchers, int maxWait)
     {
-        QPointer<QDBusPendingCallWatcher> watcher(_watcher);
+        QList<QPointer<QDBusPendingCallWatcher> > watchers;
+        Q_FOREACH(QDBusPendingCallWatcher *watcher, _watchers) {
+            watchers << watcher;
+        }
 
         if(m_type == ASYNCHRONOUS) {
+            QPointer<DBusMenuImporter> guard(q);
+            const uint generation = m_exporterGeneration;
             QTimer timer;
             timer.setSingleShot(true);
             QEventLoop loop;
             loop.connect(&timer, SIGNAL(timeout()), SLOT(quit()));
-            loop.connect(watcher, SIGNAL(finished(QDBusPendingCallWatcher *)), SLOT(quit()));
+            Q_FOREACH(const QPointer<QDBusPendingCallWatcher> &watcher, watchers) {
+                if (watcher && !watcher->isFinished()) {
+                    loop.connect(watcher, SIGNAL(finished(QDBusPendingCallWatcher *)), SLOT(quit()));
+                    loop.connect(watcher, SIGNAL(destroyed()), SLOT(quit()));
+                }
+            }
             timer.start(maxWait);
-            loop.exec();
+            m_waitLoops << &loop;
+            // One deadline for all the watchers: the loop is quit each time
+            // one of them finishes, and resumed while others are running
+            while (hasUnfinishedWatcher(watchers) && timer.isActive()) {
+                loop.exec();
+                if (!guard) {
+                    // Importer got deleted while we were waiting, "this" is
+                    // gone too. See:
+                    // https://bugs.kde.org/show_bug.cgi?id=237156
+                    return false;
+                }
+                if (generation != m_exporterGeneration) {
+                    break;
+                }
+            }
+            m_waitLoops.removeOne(&loop);
             timer.stop();
 
-            if (!watcher) {
-                // Watcher died. This can happen if importer got deleted while we were
-                // waiting. See:
-                // https://bugs.kde.org/show_bug.cgi?id=237156
+            if (generation != m_exporterGeneration) {
+                // The exporter changed meanwhile: the calls were meant for
+                // the previous one, its slowness must not count against the
+                // new one
                 return false;
             }
 
-            if(!watcher->isFinished()) {
+            if (hasUnfinishedWatcher(watchers)) {
                 // Timed out
+                registerTimeout();
                 return false;
             }
         } else {
-            watcher->waitForFinished();
+            Q_FOREACH(const QPointer<QDBusPendingCallWatcher> &watcher, watchers) {
+                if (watcher) {
+                    watcher->waitForFinished();
+                }
+            }
         }
 
-        if (watcher->isError()) {
-            DMWARNING << watcher->error().message();
-            return false;
+        bool ok = true;
+        Q_FOREACH(const QPointer<QDBusPendingCallWatcher> &watcher, watchers) {
+            if (watcher && watcher->isError()) {
+                DMWARNING << watcher->error().message();
+                ok = false;
+            }
         }
-
-        return true;
+        return ok;
     }
 };
 
@@ -332,9 +1364,24 @@ DBusMenuImporter::DBusMenuImporter(const QString &service, const QString &path,
     DBusMenuTypes_register();
 
     d->q = this;
-    d->m_interface = new QDBusInterface(service, path, DBUSMENU_INTERFACE, QDBusConnection::sessionBus(), this);
+    d->m_service = service;
+    d->m_path = path;
+    d->m_interface = 0;
     d->m_menu = 0;
     d->m_mustEmitMenuUpdated = false;
+    d->m_remoteVersion = 0;
+    d->m_prefetchDepth = -1;
+    d->m_backgroundRevalidationEnabled = false;
+    d->m_clock.start();
+    d->m_minimumTimeout = DEFAULT_MINIMUM_TIMEOUT;
+    d->m_maximumTimeout = DEFAULT_MAXIMUM_TIMEOUT;
+    d->m_consecutiveTimeoutCount = 0;
+    d->m_responsive = true;
+    d->m_exporterGeneration = 0;
+    d->m_layoutFdSupported = false;
+    d->m_iconDataHashSupported = false;
+    d->m_iconThemeName = QIcon::themeName();
+    d->m_batchIconNames = false;
 
     d->m_type = type;
 
@@ -344,16 +1391,28 @@ DBusMenuImporter::DBusMenuImporter(const QString &service, const QString &path,
     d->m_pendingLayoutUpdateTimer->setSingleShot(true);
     connect(d->m_pendingLayoutUpdateTimer, SIGNAL(timeout()), SLOT(processPendingLayoutUpdates()));
 
-    // For some reason, using QObject::connect() does not work but
-    // QDBusConnect::connect() does
-    QDBusConnection::sessionBus().connect(service, path, DBUSMENU_INTERFACE, "LayoutUpdated", "ui",
-        this, SLOT(slotLayoutUpdated(uint, int)));
-    QDBusConnection::sessionBus().connect(service, path, DBUSMENU_INTERFACE, "ItemsPropertiesUpdated", "a(ia{sv})a(ias)",
-        this, SLOT(slotItemsPropertiesUpdated(DBusMenuItemList, DBusMenuItemKeysList)));
-    QDBusConnection::sessionBus().connect(service, path, DBUSMENU_INTERFACE, "ItemActivationRequested", "iu",
-        this, SLOT(slotItemActivationRequested(int, uint)));
+    d->m_pendingEventsTimer = new QTimer(this);
+    d->m_pendingEventsTimer->setSingleShot(true);
+    d->m_pendingEventsTimer->setInterval(0);
+    connect(d->m_pendingEventsTimer, SIGNAL(timeout()), SLOT(sendPendingEvents()));
 
-    d->refresh(0);
+    d->m_iconFetchTimer = new QTimer(this);
+    d->m_iconFetchTimer->setSingleShot(true);
+    d->m_iconFetchTimer->setInterval(0);
+    connect(d->m_iconFetchTimer, SIGNAL(timeout()), SLOT(fetchPendingIcons()));
+
+    d->m_peerCheckTimer = new QTimer(this);
+    d->m_peerCheckTimer->setInterval(PEER_CHECK_INTERVAL);
+    connect(d->m_peerCheckTimer, SIGNAL(timeout()), SLOT(checkPeerConnection()));
+
+    d->m_probeTimer = new QTimer(this);
+    d->m_probeTimer->setInterval(PROBE_INTERVAL);
+    connect(d->m_probeTimer, SIGNAL(timeout()), SLOT(probeExporter()));
+
+    connect(DBusMenuIconDecoder::instance(), SIGNAL(iconDecoded(QString, QIcon)),
+        SLOT(slotIconDecoded(QString, QIcon)));
+
+    d->connectToExporter();
 }
 
 DBusMenuImporter::~DBusMenuImporter()
@@ -362,14 +1421,112 @@ DBusMenuImporter::~DBusMenuImporter()
     // leave enough time for the menu to finish what it was doing, for example
     // if it was being displayed.
     d->m_menu->deleteLater();
+    d->sendPendingEvents();
+    // The calls being waited for will not be handled anymore
+    d->quitWaitLoops();
+    d->disconnectSignals();
+    delete d->m_interface;
+    if (!d->m_peerConnectionName.isEmpty()) {
+        QDBusConnection::disconnectFromPeer(d->m_peerConnectionName);
+    }
     delete d;
 }
 
+void DBusMenuImporter::slotGetPropertiesFinished(QDBusPendingCallWatcher *watcher)
+{
+    watcher->deleteLater();
+    QDBusPendingReply<QVariantMap> reply = *watcher;
+    if (reply.isError()) {
+        DMWARNING << "Could not get exporter properties:" << reply.error().message();
+        return;
+    }
+    QVariantMap properties = reply.value();
+    d->m_remoteVersion = properties.value("Version").toUInt();
+    QStringList extensions = properties.value("QtExtensions").toStringList();
+    d->m_layoutFdSupported = extensions.contains("layout-fd");
+    d->m_iconDataHashSupported = extensions.contains("icon-data-hash");
+
+    // Only ask for a peer-to-peer connection if the exporter offers one, so
+    // that other exporters do not cost an extra round trip
+    if (!extensions.contains("peer-to-peer")) {
+        return;
+    }
+    QDBusPendingCall call = d->m_interface->asyncCall("GetPeerAddress");
+    QDBusPendingCallWatcher *watcher2 = new QDBusPendingCallWatcher(call, this);
+    connect(watcher2, SIGNAL(finished(QDBusPendingCallWatcher*)),
+        SLOT(slotGetPeerAddressFinished(QDBusPendingCallWatcher*)));
+}
+
+void DBusMenuImporter::slotGetPeerAddressFinished(QDBusPendingCallWatcher *watcher)
+{
+    watcher->deleteLater();
+    QDBusPendingReply<QString> reply = *watcher;
+    if (reply.isError() || reply.value().isEmpty()) {
+        return;
+    }
+
+    static int sPeerCount = 0;
+    QString name = QString("dbusmenu-peer-%1").arg(++sPeerCount);
+    QDBusConnection connection = QDBusConnection::connectToPeer(reply.value(), name);
+    if (!connection.isConnected()) {
+        DMWARNING << "Could not connect to" << reply.value() << ":" << connection.lastError().message();
+        QDBusConnection::disconnectFromPeer(name);
+        return;
+    }
+    d->m_peerConnectionName = name;
+    d->setConnection(connection, QString());
+    d->m_peerCheckTimer->start();
+
+    // Changes made before the signals got connected on the peer connection
+    // could have been missed
+    d->refresh(0);
+}
+
+void DBusMenuImporter::slotGetIconsFinished(QDBusPendingCallWatcher *watcher)
+{
+    QStringList hashes = watcher->property(DBUSMENU_PROPERTY_ICON_HASHES).toStringList();
+    watcher->deleteLater();
+
+    QDBusPendingReply<QVariantMap> reply = *watcher;
+    if (reply.isError()) {
+        DMWARNING << "Call to GetIcons() failed:" << reply.error().message();
+    }
+    QVariantMap icons = reply.value();
+
+    Q_FOREACH(const QString &dataHash, hashes) {
+        QVariantMap::ConstIterator it = icons.constFind(dataHash);
+        if (it != icons.constEnd()) {
+            QByteArray data = it.value().toByteArray();
+            // The icon cache is shared with the importers of other
+            // applications: never store data under a hash it does not have
+            if (iconDataHash(data) != dataHash) {
+                DMWARNING << "Exporter sent icon data which does not match hash" << dataHash;
+                d->slotIconDecoded(dataHash, QIcon());
+                continue;
+            }
+            DBusMenuIconDecoder::instance()->decode(dataHash, data);
+        } else {
+            if (!reply.isError()) {
+                DMWARNING << "Exporter does not know icon with hash" << dataHash;
+            }
+            d->slotIconDecoded(dataHash, QIcon());
+        }
+    }
+}
+
 void DBusMenuImporter::slotLayoutUpdated(uint revision, int parentId)
 {
     if (d->m_idsRefreshedByAboutToShow.remove(parentId)) {
         return;
     }
+    // Some exporters do not maintain revisions and always send 0
+    if (revision != 0 && d->m_revisionForId.contains(parentId)
+        && revision <= d->m_revisionForId.value(parentId))
+    {
+        // The layout we have already includes this change
+        return;
+    }
+    d->markRefreshesOutdated(parentId);
     d->m_pendingLayoutUpdates << parentId;
     if (!d->m_pendingLayoutUpdateTimer->isActive()) {
         d->m_pendingLayoutUpdateTimer->start();
@@ -378,13 +1535,54 @@ void DBusMenuImporter::slotLayoutUpdated(uint revision, int parentId)
 
 void DBusMenuImporter::processPendingLayoutUpdates()
 {
-    QSet<int> ids = d->m_pendingLayoutUpdates;
+    QList<int> ids;
+    Q_FOREACH(int id, d->m_pendingLayoutUpdates) {
+        if (!d->hasPendingAncestor(id)) {
+            ids << id;
+        }
+    }
     d->m_pendingLayoutUpdates.clear();
+
     Q_FOREACH(int id, ids) {
-        d->refresh(id);
+        if (d->runningRefreshCount() >= MAX_CONCURRENT_LAYOUT_UPDATES) {
+            // Processed again when a running request finishes
+            d->m_pendingLayoutUpdates << id;
+        } else {
+            d->refresh(id);
+        }
     }
 }
 
+void DBusMenuImporter::setLayoutUpdateDelay(int msecs)
+{
+    d->m_pendingLayoutUpdateTimer->setInterval(msecs);
+}
+
+int DBusMenuImporter::layoutUpdateDelay() const
+{
+    return d->m_pendingLayoutUpdateTimer->interval();
+}
+
+void DBusMenuImporter::setIconCacheSize(int kilobytes)
+{
+    DBusMenuIconCache::instance()->setMaxSize(kilobytes);
+}
+
+int DBusMenuImporter::iconCacheSize()
+{
+    return DBusMenuIconCache::instance()->maxSize();
+}
+
+qint64 DBusMenuImporter::iconCacheHitCount()
+{
+    return DBusMenuIconCache::instance()->hitCount();
+}
+
+qint64 DBusMenuImporter::iconCacheMissCount()
+{
+    return DBusMenuIconCache::instance()->missCount();
+}
+
 QMenu *DBusMenuImporter::menu() const
 {
     if (!d->m_menu) {
@@ -408,6 +1606,11 @@ void DBusMenuImporterPrivate::slotItemsPropertiesUpdated(const DBusMenuItemList
         for(; it != end; ++it) {
             updateActionProperty(action, it.key(), it.value());
         }
+        QVariant keys = action->property(DBUSMENU_PROPERTY_KEYS);
+        if (keys.isValid()) {
+            QSet<QString> keySet = keys.toStringList().toSet() + item.properties.keys().toSet();
+            action->setProperty(DBUSMENU_PROPERTY_KEYS, QStringList(keySet.toList()));
+        }
     }
 
     Q_FOREACH(const DBusMenuItemKeys &item, removedList) {
@@ -420,6 +1623,11 @@ void DBusMenuImporterPrivate::slotItemsPropertiesUpdated(const DBusMenuItemList
         Q_FOREACH(const QString &key, item.properties) {
             updateActionProperty(action, key, QVariant());
         }
+        QVariant keys = action->property(DBUSMENU_PROPERTY_KEYS);
+        if (keys.isValid()) {
+            QSet<QString> keySet = keys.toStringList().toSet() - item.properties.toSet();
+            action->setProperty(DBUSMENU_PROPERTY_KEYS, QStringList(keySet.toList()));
+        }
     }
 }
 
@@ -430,21 +1638,176 @@ void DBusMenuImporter::slotItemActivationRequested(int id, uint /*timestamp*/)
     actionActivationRequested(action);
 }
 
+/**
+ * Creates the actions of a menu while the GetLayout() reply is being read,
+ * without going through an intermediate DBusMenuLayoutItem tree
+ */
+class DBusMenuLayoutBuilder : public DBusMenuLayoutVisitor
+{
+public:
+    /**
+     * depth is the recursion depth which has been requested to GetLayout(),
+     * -1 meaning the whole subtree of menu. revision is the layout revision
+     * returned with the reply.
+     */
+    DBusMenuLayoutBuilder(DBusMenuImporterPrivate *d, QMenu *menu, int depth, uint revision)
+    : m_d(d)
+    , m_rootMenu(menu)
+    , m_depth(depth)
+    , m_revision(revision)
+    {}
+
+    void beginItem(int id, const QVariantMap &properties, int depth)
+    {
+        if (depth == 0) {
+            m_levels << Level(m_rootMenu);
+            m_d->m_unfetchedMenuIds.remove(id);
+            m_d->m_revisionForId.insert(id, m_revision);
+            return;
+        }
+        if (depth != m_levels.count()) {
+            // Children of an item we could not turn into a menu
+            return;
+        }
+        Level &level = m_levels.last();
+        QAction *action = itemAction(level.menu, id, properties);
+        level.actions << action;
+
+        if (!action->menu()) {
+            return;
+        }
+        if (m_d->m_revisionForId.value(id, 0) > m_revision) {
+            // This submenu has been filled by a more recent reply, keep it
+        } else if (m_depth < 0 || depth < m_depth) {
+            // The reply contains the children of this item: fill its menu
+            // now instead of requesting it
+            m_levels << Level(action->menu());
+            m_d->m_unfetchedMenuIds.remove(id);
+            m_d->m_revisionForId.insert(id, m_revision);
+        } else if (!level.reused.contains(action)) {
+            // Fetched when it is about to be shown
+            m_d->m_unfetchedMenuIds << id;
+        }
+    }
+
+    void endItem(int /*id*/, int depth)
+    {
+        if (depth + 1 == m_levels.count()) {
+            finish(m_levels.takeLast());
+        }
+    }
+
+private:
+    struct Level
+    {
+        Level(QMenu *_menu = 0)
+        : menu(_menu)
+        {}
+
+        QMenu *menu;
+        QList<QAction *> actions;
+        QSet<QAction *> reused;
+    };
+
+    QAction *itemAction(QMenu *menu, int id, const QVariantMap &properties)
+    {
+        // Reuse the existing action for this id if possible, so that it keeps
+        // its icon, shortcut and submenu
+        QAction *action = m_d->m_actionForId.value(id);
+        if (action && action->parent() == menu
+            && DBusMenuImporterPrivate::canReuseAction(action, properties))
+        {
+            m_d->reuseAction(action, properties);
+            m_levels.last().reused << action;
+            return action;
+        }
+
+        action = m_d->createAction(id, properties, menu);
+        m_d->m_actionForId.insert(id, action);
+
+        QObject::connect(action, SIGNAL(triggered()),
+            &m_d->m_mapper, SLOT(map()));
+        m_d->m_mapper.setMapping(action, id);
+        return action;
+    }
+
+    /**
+     * Removes the actions which are not part of the layout anymore and puts
+     * the others in the right order. Actions which did not move are left
+     * untouched.
+     */
+    void finish(const Level &level)
+    {
+        QMenu *menu = level.menu;
+        QSet<QAction *> wanted = level.actions.toSet();
+        QSet<QAction *> unwanted;
+        Q_FOREACH(QAction *action, menu->actions()) {
+            if (!wanted.contains(action)) {
+                unwanted << action;
+            }
+        }
+        m_d->deleteActions(unwanted);
+
+        if (menu->actions() == level.actions) {
+            return;
+        }
+        for (int pos = 0; pos < level.actions.count(); ++pos) {
+            QList<QAction *> current = menu->actions();
+            QAction *action = level.actions.at(pos);
+            if (pos < current.count() && current.at(pos) == action) {
+                continue;
+            }
+            // Adds action or moves it if it is already in the menu
+            menu->insertAction(pos < current.count() ? current.at(pos) : 0, action);
+        }
+    }
+
+    DBusMenuImporterPrivate *m_d;
+    QMenu *m_rootMenu;
+    int m_depth;
+    uint m_revision;
+    QList<Level> m_levels;
+};
+
 void DBusMenuImporter::slotGetLayoutFinished(QDBusPendingCallWatcher *watcher)
 {
     int parentId = watcher->property(DBUSMENU_PROPERTY_ID).toInt();
     watcher->deleteLater();
+    d->measureReply(&d->m_refreshLatency, watcher);
+    if (d->m_refreshWatchers.value(parentId) == watcher) {
+        d->m_refreshWatchers.remove(parentId);
+    }
+    if (!d->m_pendingLayoutUpdates.isEmpty() && !d->m_pendingLayoutUpdateTimer->isActive()) {
+        // Some updates have been held back by MAX_CONCURRENT_LAYOUT_UPDATES
+        d->m_pendingLayoutUpdateTimer->start();
+    }
+
+    if (watcher->property(DBUSMENU_PROPERTY_SUPERSEDED).toBool()) {
+        // A newer request has been sent, this reply is outdated
+        return;
+    }
+
+    if (watcher->isError()) {
+        DMWARNING << watcher->error().message();
+        if (watcher->property(DBUSMENU_PROPERTY_COMPLETES_SHOW).toBool()) {
+            d->emitMenuUpdatedIfNeeded(parentId, true);
+        }
+        return;
+    }
 
-    QDBusPendingReply<uint, DBusMenuLayoutItem> reply = *watcher;
-    if (!reply.isValid()) {
-        DMWARNING << reply.error().message();
+    // Do not use QDBusPendingReply<uint, DBusMenuLayoutItem>: it would
+    // demarshall the whole tree, we walk the raw reply instead
+    QDBusMessage message = watcher->reply();
+    QVariantList arguments = message.arguments();
+    int layoutType = arguments.count() == 2 ? arguments.at(1).userType() : QMetaType::Void;
+    if (layoutType != qMetaTypeId<QDBusArgument>() && layoutType != qMetaTypeId<QDBusVariant>()) {
+        DMWARNING << "Invalid GetLayout() reply, signature is" << message.signature();
         return;
     }
 
     #ifdef BENCHMARK
     DMDEBUG << "- items received:" << sChrono.elapsed() << "ms";
     #endif
-    DBusMenuLayoutItem rootItem = reply.argumentAt<1>();
 
     QMenu *menu = d->menuForId(parentId);
     if (!menu) {
@@ -452,33 +1815,109 @@ void DBusMenuImporter::slotGetLayoutFinished(QDBusPendingCallWatcher *watcher)
         return;
     }
 
-    menu->clear();
-
-    Q_FOREACH(const DBusMenuLayoutItem &dbusMenuItem, rootItem.children) {
-        QAction *action = d->createAction(dbusMenuItem.id, dbusMenuItem.properties, menu);
-        DBusMenuImporterPrivate::ActionForId::Iterator it = d->m_actionForId.find(dbusMenuItem.id);
-        if (it == d->m_actionForId.end()) {
-            d->m_actionForId.insert(dbusMenuItem.id, action);
-        } else {
-            delete *it;
-            *it = action;
+    uint revision = arguments.at(0).toUInt();
+    if (d->m_revisionForId.contains(parentId) && revision < d->m_revisionForId.value(parentId)) {
+        // A more recent layout has already been applied
+        if (watcher->property(DBUSMENU_PROPERTY_COMPLETES_SHOW).toBool()) {
+            d->emitMenuUpdatedIfNeeded(parentId, true);
         }
-        menu->addAction(action);
-
-        connect(action, SIGNAL(triggered()),
-            &d->m_mapper, SLOT(map()));
-        d->m_mapper.setMapping(action, dbusMenuItem.id);
+        return;
+    }
 
-        if( action->menu() )
-        {
-          d->refresh( dbusMenuItem.id )->waitForFinished();
+    DBusMenuLayoutBuilder builder(d, menu, watcher->property(DBUSMENU_PROPERTY_DEPTH).toInt(), revision);
+    d->m_batchIconNames = true;
+    if (layoutType == qMetaTypeId<QDBusVariant>()) {
+        // GetLayoutFd() reply
+        DBusMenuPayloadReader reader(arguments.at(1).value<QDBusVariant>().variant());
+        if (!reader.isValid()) {
+            d->m_batchIconNames = false;
+            return;
         }
+        QDataStream stream(reader.data());
+        if (!DBusMenuTypes_readLayout(stream, &builder)) {
+            DMWARNING << "Invalid layout stream for id" << parentId;
+        }
+    } else {
+        DBusMenuTypes_readLayout(arguments.at(1).value<QDBusArgument>(), &builder);
+    }
+    d->resolvePendingIconNames();
+    if (watcher->property(DBUSMENU_PROPERTY_COMPLETES_SHOW).toBool()) {
+        d->emitMenuUpdatedIfNeeded(parentId, true);
     }
     #ifdef BENCHMARK
     DMDEBUG << "- Menu filled:" << sChrono.elapsed() << "ms";
     #endif
 }
 
+void DBusMenuImporter::setPrefetchDepth(int depth)
+{
+    d->m_prefetchDepth = depth;
+}
+
+int DBusMenuImporter::prefetchDepth() const
+{
+    return d->m_prefetchDepth;
+}
+
+void DBusMenuImporter::setBackgroundRevalidationEnabled(bool enabled)
+{
+    d->m_backgroundRevalidationEnabled = enabled;
+}
+
+bool DBusMenuImporter::isBackgroundRevalidationEnabled() const
+{
+    return d->m_backgroundRevalidationEnabled;
+}
+
+void DBusMenuImporter::setTimeoutBounds(int minimum, int maximum)
+{
+    DMRETURN_IF_FAIL(minimum > 0 && minimum <= maximum);
+    d->m_minimumTimeout = minimum;
+    d->m_maximumTimeout = maximum;
+}
+
+int DBusMenuImporter::minimumTimeout() const
+{
+    return d->m_minimumTimeout;
+}
+
+int DBusMenuImporter::maximumTimeout() const
+{
+    return d->m_maximumTimeout;
+}
+
+int DBusMenuImporter::aboutToShowTimeout() const
+{
+    return d->aboutToShowTimeout();
+}
+
+int DBusMenuImporter::refreshTimeout() const
+{
+    return d->refreshTimeout();
+}
+
+void DBusMenuImporter::rebind(const QString &service, const QString &path)
+{
+    // Events are meant for the previous exporter
+    d->sendPendingEvents();
+    d->resetExporterState();
+
+    QString peerConnectionName = d->m_peerConnectionName;
+    d->m_peerConnectionName.clear();
+    d->m_peerCheckTimer->stop();
+    d->m_service = service;
+    d->m_path = path;
+    d->connectToExporter();
+    if (!peerConnectionName.isEmpty()) {
+        QDBusConnection::disconnectFromPeer(peerConnectionName);
+    }
+}
+
+bool DBusMenuImporter::isResponsive() const
+{
+    return d->m_responsive;
+}
+
 void DBusMenuImporter::sendClickedEvent(int id)
 {
     d->sendEvent(id, QString("clicked"));
@@ -500,21 +1939,64 @@ void DBusMenuImporter::slotMenuAboutToShow()
 
     int id = action->property(DBUSMENU_PROPERTY_ID).toInt();
 
+    // Pick up icon theme changes before the menu is shown
+    d->checkIconTheme();
+
     #ifdef BENCHMARK
     QTime time;
     time.start();
     #endif
 
-    QDBusPendingCall call = d->m_interface->asyncCall("AboutToShow", id);
-    QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(call, this);
-    watcher->setProperty(DBUSMENU_PROPERTY_ID, id);
-    connect(watcher, SIGNAL(finished(QDBusPendingCallWatcher*)),
-        SLOT(slotAboutToShowDBusCallFinished(QDBusPendingCallWatcher*)));
-
     QPointer<QObject> guard(this);
+    const uint generation = d->m_exporterGeneration;
+
+    const bool nonBlocking = d->showsWithoutWaiting(menu, id);
+    if (!nonBlocking && !d->waitForPrefetch(id)) {
+        return;
+    }
+
+    if (d->isPrefetching(id)) {
+        // Only when not waiting: the prefetch will update the menu
+    } else if (d->m_idsPreparedByAboutToShowGroup.remove(id)) {
+        // The AboutToShowGroup() call of the parent menu already took care
+        // of this menu, but it may not have been fetched yet
+        if (d->m_unfetchedMenuIds.contains(id)) {
+            d->refreshAfterAboutToShow(QList<int>() << id, nonBlocking);
+        }
+    } else if (d->m_remoteVersion >= GROUP_METHODS_VERSION) {
+        // Prepare the submenus in the same call, so that browsing them does
+        // not cost one more round trip each
+        QList<int> ids;
+        ids << id;
+        Q_FOREACH(QAction *subAction, menu->actions()) {
+            if (subAction->menu()) {
+                ids << subAction->property(DBUSMENU_PROPERTY_ID).toInt();
+            }
+        }
+        QDBusPendingCall call = d->m_interface->asyncCall("AboutToShowGroup", QVariant::fromValue(ids));
+        QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(call, this);
+        watcher->setProperty(DBUSMENU_PROPERTY_ID, id);
+        watcher->setProperty(DBUSMENU_PROPERTY_GROUP_IDS, QVariant::fromValue(ids));
+        watcher->setProperty(DBUSMENU_PROPERTY_NONBLOCKING, nonBlocking);
+        d->startLatencyMeasure(watcher);
+        connect(watcher, SIGNAL(finished(QDBusPendingCallWatcher*)),
+            SLOT(slotAboutToShowGroupDBusCallFinished(QDBusPendingCallWatcher*)));
+
+        if (!nonBlocking && !d->waitForWatcher(watcher, d->aboutToShowTimeout())) {
+            DMWARNING << "Application did not answer to AboutToShowGroup() before timeout";
+        }
+    } else {
+        QDBusPendingCall call = d->m_interface->asyncCall("AboutToShow", id);
+        QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(call, this);
+        watcher->setProperty(DBUSMENU_PROPERTY_ID, id);
+        watcher->setProperty(DBUSMENU_PROPERTY_NONBLOCKING, nonBlocking);
+        d->startLatencyMeasure(watcher);
+        connect(watcher, SIGNAL(finished(QDBusPendingCallWatcher*)),
+            SLOT(slotAboutToShowDBusCallFinished(QDBusPendingCallWatcher*)));
 
-    if (!d->waitForWatcher(watcher, ABOUT_TO_SHOW_TIMEOUT)) {
-        DMWARNING << "Application did not answer to AboutToShow() before timeout";
+        if (!nonBlocking && !d->waitForWatcher(watcher, d->aboutToShowTimeout())) {
+            DMWARNING << "Application did not answer to AboutToShow() before timeout";
+        }
     }
 
     #ifdef BENCHMARK
@@ -525,7 +2007,8 @@ void DBusMenuImporter::slotMenuAboutToShow()
         return;
     }
 
-    if (menu == d->m_menu && d->m_mustEmitMenuUpdated) {
+    // When not waiting, menuUpdated() is emitted when the replies arrive
+    if (menu == d->m_menu && d->m_mustEmitMenuUpdated && !nonBlocking) {
         d->m_mustEmitMenuUpdated = false;
         menuUpdated();
     }
@@ -533,17 +2016,23 @@ void DBusMenuImporter::slotMenuAboutToShow()
         menuReadyToBeShown();
     }
 
-    d->sendEvent(id, QString("opened"));
+    // id belongs to the previous exporter if rebind() was called meanwhile
+    if (generation == d->m_exporterGeneration) {
+        d->sendEvent(id, QString("opened"));
+    }
 }
 
 void DBusMenuImporter::slotAboutToShowDBusCallFinished(QDBusPendingCallWatcher *watcher)
 {
     int id = watcher->property(DBUSMENU_PROPERTY_ID).toInt();
+    bool nonBlocking = watcher->property(DBUSMENU_PROPERTY_NONBLOCKING).toBool();
     watcher->deleteLater();
+    d->measureReply(&d->m_aboutToShowLatency, watcher);
 
     QDBusPendingReply<bool> reply = *watcher;
     if (reply.isError()) {
         DMWARNING << "Call to AboutToShow() failed:" << reply.error().message();
+        d->emitMenuUpdatedIfNeeded(id, nonBlocking);
         return;
     }
     bool needRefresh = reply.argumentAt<0>();
@@ -551,13 +2040,63 @@ void DBusMenuImporter::slotAboutToShowDBusCallFinished(QDBusPendingCallWatcher *
     QMenu *menu = d->menuForId(id);
     DMRETURN_IF_FAIL(menu);
 
-    if (needRefresh || menu->actions().isEmpty()) {
-        d->m_idsRefreshedByAboutToShow << id;
-        QDBusPendingCallWatcher *watcher2 = d->refresh(id);
-        if (!d->waitForWatcher(watcher2, REFRESH_TIMEOUT)) {
-            DMWARNING << "Application did not refresh before timeout";
+    if (needRefresh) {
+        // A running request may have been sent before the menu changed
+        d->markRefreshesOutdated(id);
+    }
+
+    if (needRefresh || menu->actions().isEmpty() || d->m_unfetchedMenuIds.contains(id)) {
+        d->refreshAfterAboutToShow(QList<int>() << id, nonBlocking);
+    } else {
+        d->emitMenuUpdatedIfNeeded(id, nonBlocking);
+    }
+}
+
+void DBusMenuImporter::slotAboutToShowGroupDBusCallFinished(QDBusPendingCallWatcher *watcher)
+{
+    int id = watcher->property(DBUSMENU_PROPERTY_ID).toInt();
+    QList<int> ids = watcher->property(DBUSMENU_PROPERTY_GROUP_IDS).value<QList<int> >();
+    bool nonBlocking = watcher->property(DBUSMENU_PROPERTY_NONBLOCKING).toBool();
+    watcher->deleteLater();
+    d->measureReply(&d->m_aboutToShowLatency, watcher);
+
+    QDBusPendingReply<QList<int>, QList<int> > reply = *watcher;
+    if (reply.isError()) {
+        DMWARNING << "Call to AboutToShowGroup() failed:" << reply.error().message();
+        d->emitMenuUpdatedIfNeeded(id, nonBlocking);
+        return;
+    }
+    QList<int> updatesNeeded = reply.argumentAt<0>();
+    QList<int> idErrors = reply.argumentAt<1>();
+    if (!idErrors.isEmpty()) {
+        DMWARNING << "AboutToShowGroup() could not find ids" << idErrors;
+    }
+
+    QMenu *menu = d->menuForId(id);
+    DMRETURN_IF_FAIL(menu);
+
+    // Running requests for these menus may have been sent before they
+    // changed
+    Q_FOREACH(int updatedId, updatesNeeded) {
+        d->markRefreshesOutdated(updatedId);
+    }
+
+    if ((menu->actions().isEmpty() || d->m_unfetchedMenuIds.contains(id)) && !updatesNeeded.contains(id)) {
+        updatesNeeded << id;
+    }
+
+    Q_FOREACH(int subId, ids) {
+        if (subId != id && !idErrors.contains(subId)) {
+            d->m_idsPreparedByAboutToShowGroup << subId;
         }
     }
+
+    if (!updatesNeeded.isEmpty()) {
+        d->refreshAfterAboutToShow(updatesNeeded, nonBlocking);
+    }
+    if (!updatesNeeded.contains(id)) {
+        d->emitMenuUpdatedIfNeeded(id, nonBlocking);
+    }
 }
 
 void DBusMenuImporter::slotMenuAboutToHide()
@@ -570,6 +2109,14 @@ void DBusMenuImporter::slotMenuAboutToHide()
 
     int id = action->property(DBUSMENU_PROPERTY_ID).toInt();
     d->sendEvent(id, QString("closed"));
+
+    // Submenus which have not been shown must get an AboutToShow() the next
+    // time they are
+    Q_FOREACH(QAction *subAction, menu->actions()) {
+        if (subAction->menu()) {
+            d->m_idsPreparedByAboutToShowGroup.remove(subAction->property(DBUSMENU_PROPERTY_ID).toInt());
+        }
+    }
 }
 
 QMenu *DBusMenuImporter::createMenu(QWidget *parent)
@@ -38,11 +38,16 @@ class DBusMenuImporterPrivate;
 
 /**
  * Determine whether internal method calls should allow the Qt event loop
- * to execute or not
+ * to execute or not.
+ *
+ * With NONBLOCKING, menus never wait for the application: they are shown
+ * right away with their current content, which is updated in place when the
+ * replies arrive.
  */
 enum DBusMenuImporterType {
     ASYNCHRONOUS,
-    SYNCHRONOUS
+    SYNCHRONOUS,
+    NONBLOCKING
 };
 
 /**
@@ -59,8 +64,8 @@ public:
     DBusMenuImporter(const QString &service, const QString &path, QObject *parent = 0);
 
     /**
-     * Creates a DBusMenuImporter listening over DBus on service, path, with either async
-     * or sync DBus calls
+     * Creates a DBusMenuImporter listening over DBus on service, path, with either async,
+     * sync or non-blocking DBus calls
      */
     DBusMenuImporter(const QString &service, const QString &path, DBusMenuImporterType type, QObject *parent = 0);
 
@@ -71,6 +76,129 @@ public:
      */
     QMenu *menu() const;
 
+    /**
+     * Makes the importer show the menu exported by another application, at
+     * path of service. This is faster than creating a new importer: the root
+     * menu, the bus subscriptions and the settings of the importer are kept.
+     * The actions of the previous menu are deleted.
+     */
+    void rebind(const QString &service, const QString &path);
+
+    /**
+     * Sets how many levels of submenus are fetched along with a menu. Deeper
+     * submenus are only fetched when they are about to be shown, which saves
+     * bus traffic and memory for large menus. 0 fetches each menu when it
+     * is shown. Defaults to -1, which fetches the whole menu tree at once.
+     *
+     * The menu is first fetched when the event loop runs, call this method
+     * right after creating the importer for it to apply to the first fetch.
+     */
+    void setPrefetchDepth(int depth);
+
+    /**
+     * Returns the prefetch depth
+     * @ref setPrefetchDepth
+     */
+    int prefetchDepth() const;
+
+    /**
+     * When enabled, a menu which has already been fetched is shown right
+     * away with its current content, while AboutToShow() and the refresh
+     * it may require run in the background. Differences are applied in
+     * place when they arrive. Menus which have not been fetched yet are
+     * still waited for. Disabled by default.
+     *
+     * This has no effect with NONBLOCKING importers, which never wait.
+     */
+    void setBackgroundRevalidationEnabled(bool enabled);
+
+    /**
+     * Returns whether background revalidation is enabled
+     * @ref setBackgroundRevalidationEnabled
+     */
+    bool isBackgroundRevalidationEnabled() const;
+
+    /**
+     * The importer measures how long the application takes to answer, and
+     * waits up to three times the 99th percentile of these latencies when a
+     * menu is about to be shown. This sets the bounds of these timeouts, in
+     * milliseconds. Defaults to 500 and 10000.
+     */
+    void setTimeoutBounds(int minimum, int maximum);
+
+    /**
+     * Returns the lower bound of the timeouts
+     * @ref setTimeoutBounds
+     */
+    int minimumTimeout() const;
+
+    /**
+     * Returns the upper bound of the timeouts
+     * @ref setTimeoutBounds
+     */
+    int maximumTimeout() const;
+
+    /**
+     * Returns how long the importer currently waits for the application to
+     * prepare a menu which is about to be shown, in milliseconds
+     */
+    int aboutToShowTimeout() const;
+
+    /**
+     * Returns how long the importer currently waits for the content of a menu
+     * which is about to be shown, in milliseconds
+     */
+    int refreshTimeout() const;
+
+    /**
+     * Returns false if the application did not answer several times in a
+     * row. Menus are then shown right away with their current content,
+     * without waiting for the application, until it answers again.
+     * @see responsivenessChanged()
+     */
+    bool isResponsive() const;
+
+    /**
+     * LayoutUpdated signals received within msecs of the first one are
+     * handled together, so that a burst of changes causes a single refresh
+     * of each menu. A menu is not refreshed on its own if one of its
+     * ancestors is refreshed with it. Defaults to 0, which only groups
+     * signals received in the same event loop iteration.
+     */
+    void setLayoutUpdateDelay(int msecs);
+
+    /**
+     * Returns the delay used to group LayoutUpdated signals
+     * @ref setLayoutUpdateDelay
+     */
+    int layoutUpdateDelay() const;
+
+    /**
+     * Decoded icon-data icons are kept in a cache shared by all the importers
+     * of the process, so that icons used by several items, menus or
+     * applications are decoded once. This sets the maximum size of the cache,
+     * in kilobytes of decoded pixels. The least recently used icons are
+     * removed first. Defaults to 4096.
+     */
+    static void setIconCacheSize(int kilobytes);
+
+    /**
+     * Returns the maximum size of the icon cache.
+     * @ref setIconCacheSize
+     */
+    static int iconCacheSize();
+
+    /**
+     * Number of icons found in the icon cache since the process started
+     */
+    static qint64 iconCacheHitCount();
+
+    /**
+     * Number of icons which had to be decoded or fetched since the process
+     * started
+     */
+    static qint64 iconCacheMissCount();
+
 public Q_SLOTS:
     /**
      * Simulates a QMenu::aboutToShow() signal on the menu returned by menu(),
@@ -108,6 +236,12 @@ Q_SIGNALS:
      */
     void actionActivationRequested(QAction *);
 
+    /**
+     * Emitted when the application stops answering or answers again
+     * @see isResponsive()
+     */
+    void responsivenessChanged(bool responsive);
+
 protected:
     /**
      * Must create a menu, may be customized to fit host appearance.
@@ -118,6 +252,20 @@ protected:
     /**
      * Must convert a name into an icon.
      * Default implementation returns a null icon.
+     *
+     * Results are cached: this method is called once per name until the
+     * icon theme changes.
+     *
+     * To resolve all the names of a layout at once, subclasses can also
+     * implement this Q_INVOKABLE method:
+     *
+     * @code
+     * Q_INVOKABLE QVariantMap iconsForNames(const QStringList &names);
+     * @endcode
+     *
+     * It is called with the names of a freshly fetched layout which are not in
+     * the cache, and must return a map of name to QIcon. iconForName() is
+     * still used for names found later on.
      */
     virtual QIcon iconForName(const QString &);
 
@@ -126,6 +274,10 @@ private Q_SLOTS:
     void slotMenuAboutToShow();
     void slotMenuAboutToHide();
     void slotAboutToShowDBusCallFinished(QDBusPendingCallWatcher *);
+    void slotAboutToShowGroupDBusCallFinished(QDBusPendingCallWatcher *);
+    void slotGetPropertiesFinished(QDBusPendingCallWatcher *);
+    void slotGetPeerAddressFinished(QDBusPendingCallWatcher *);
+    void slotGetIconsFinished(QDBusPendingCallWatcher *);
     void slotItemActivationRequested(int id, uint timestamp);
     void processPendingLayoutUpdates();
     void slotLayoutUpdated(uint revision, int parentId);
@@ -136,8 +288,15 @@ private:
     DBusMenuImporterPrivate *const d;
     friend class DBusMenuImporterPrivate;
 
-    // Use Q_PRIVATE_SLOT to avoid exposing DBusMenuItemList
-    Q_PRIVATE_SLOT(d, void slotItemsPropertiesUpdated(const DBusMenuItemList &updatedList, const DBusMenuItemKeysList &removedList))
+    Q_PRIVATE_SLOT(d, void refreshRootMenu())
+    Q_PRIVATE_SLOT(d, void slotActionHovered(QAction *))
+    Q_PRIVATE_SLOT(d, void slotPrefetchFinished(QDBusPendingCallWatcher *))
+    Q_PRIVATE_SLOT(d, void probeExporter())
+    Q_PRIVATE_SLOT(d, void slotProbeFinished(QDBusPendingCallWatcher *))
+    Q_PRIVATE_SLOT(d, void checkPeerConnection())
+    Q_PRIVATE_SLOT(d, void sendPendingEvents())
+    Q_PRIVATE_SLOT(d, void fetchPendingIcons())
+    Q_PRIVATE_SLOT(d, void slotIconDecoded(const QString &, const QIcon &))
 };
 
 #endif /* DBUSMENUIMPORTER_H */
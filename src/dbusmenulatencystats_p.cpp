@@ -0,0 +1,66 @@
+/* This file is part of the dbusmenu-qt library
+   Copyright 2010 Canonical
+   Author: Aurelien Gateau <aurelien.gateau@canonical.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License (LGPL) as published by the Free Software Foundation;
+   either version 2 of the License, or (at your option) any later
+   version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+#include "dbusmenulatencystats_p.h"
+
+// Qt
+#include <QtAlgorithms>
+
+// Recent enough to follow changes in the application behavior, large enough
+// for the percentiles to mean something
+static const int MAX_SAMPLE_COUNT = 64;
+
+DBusMenuLatencyStats::DBusMenuLatencyStats()
+: m_next(0)
+{
+    m_samples.reserve(MAX_SAMPLE_COUNT);
+}
+
+void DBusMenuLatencyStats::addSample(int msecs)
+{
+    if (m_samples.count() < MAX_SAMPLE_COUNT) {
+        m_samples << msecs;
+    } else {
+        m_samples[m_next] = msecs;
+        m_next = (m_next + 1) % MAX_SAMPLE_COUNT;
+    }
+}
+
+int DBusMenuLatencyStats::sampleCount() const
+{
+    return m_samples.count();
+}
+
+int DBusMenuLatencyStats::percentile(int percent) const
+{
+    if (m_samples.isEmpty()) {
+        return -1;
+    }
+    QVector<int> sorted = m_samples;
+    qSort(sorted);
+    int index = (sorted.count() * percent + 99) / 100 - 1;
+    return sorted.at(qBound(0, index, sorted.count() - 1));
+}
+
+void DBusMenuLatencyStats::clear()
+{
+    m_samples.clear();
+    m_next = 0;
+}
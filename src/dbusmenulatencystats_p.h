@@ -0,0 +1,57 @@
+/* This file is part of the dbusmenu-qt library
+   Copyright 2010 Canonical
+   Author: Aurelien Gateau <aurelien.gateau@canonical.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License (LGPL) as published by the Free Software Foundation;
+   either version 2 of the License, or (at your option) any later
+   version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+#ifndef DBUSMENULATENCYSTATS_P_H
+#define DBUSMENULATENCYSTATS_P_H
+
+// Qt
+#include <QtCore/QVector>
+
+/**
+ * Keeps the most recent latencies measured for one kind of call, to derive
+ * timeouts from them.
+ * @internal
+ */
+class DBusMenuLatencyStats
+{
+public:
+    DBusMenuLatencyStats();
+
+    void addSample(int msecs);
+
+    /**
+     * Number of samples kept, at most a few dozens
+     */
+    int sampleCount() const;
+
+    /**
+     * Returns the latency which percent percent of the samples do not
+     * exceed, or -1 if there are no samples
+     */
+    int percentile(int percent) const;
+
+    void clear();
+
+private:
+    QVector<int> m_samples;
+    int m_next;
+};
+
+#endif /* DBUSMENULATENCYSTATS_P_H */
@@ -0,0 +1,172 @@
+/* This file is part of the dbusmenu-qt library
+   Copyright 2010 Canonical
+   Author: Aurelien Gateau <aurelien.gateau@canonical.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License (LGPL) as published by the Free Software Foundation;
+   either version 2 of the License, or (at your option) any later
+   version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+#include "dbusmenupayload_p.h"
+
+// Qt
+#include <QDataStream>
+#include <QDBusConnection>
+#include <QDBusUnixFileDescriptor>
+
+// Local
+#include "dbusmenu_config.h"
+#include "dbusmenutypes_p.h"
+#include "debug_p.h"
+
+// System
+#ifdef HAVE_MEMFD_CREATE
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Below this size, the cost of creating and mapping a memfd is higher than
+// the cost of copying the bytes
+static const int MIN_FD_PAYLOAD_SIZE = 32 * 1024;
+
+#ifdef HAVE_MEMFD_CREATE
+// Seals which guarantee the other side cannot change the content, or make
+// us crash by truncating it, while we read it
+static const int REQUIRED_SEALS = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE;
+
+static int createSealedFd(const QByteArray &data)
+{
+    int fd = memfd_create("dbusmenu-layout", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1) {
+        DMWARNING << "memfd_create() failed:" << strerror(errno);
+        return -1;
+    }
+
+    const char *ptr = data.constData();
+    qint64 left = data.size();
+    while (left > 0) {
+        ssize_t written = write(fd, ptr, left);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            DMWARNING << "Could not write layout to memfd:" << strerror(errno);
+            close(fd);
+            return -1;
+        }
+        ptr += written;
+        left -= written;
+    }
+
+    if (fcntl(fd, F_ADD_SEALS, REQUIRED_SEALS | F_SEAL_SEAL) == -1) {
+        DMWARNING << "Could not seal memfd:" << strerror(errno);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+#endif
+
+QDBusVariant DBusMenuPayload_fromLayout(const DBusMenuLayoutItem &item, const QDBusConnection &connection)
+{
+    QByteArray data;
+    {
+        QDataStream stream(&data, QIODevice::WriteOnly);
+        DBusMenuTypes_writeLayout(stream, item);
+    }
+
+#ifdef HAVE_MEMFD_CREATE
+    if (data.size() >= MIN_FD_PAYLOAD_SIZE
+        && (connection.connectionCapabilities() & QDBusConnection::UnixFileDescriptorPassing))
+    {
+        int fd = createSealedFd(data);
+        if (fd != -1) {
+            QDBusUnixFileDescriptor descriptor;
+            descriptor.giveFileDescriptor(fd);
+            return QDBusVariant(QVariant::fromValue(descriptor));
+        }
+    }
+#else
+    Q_UNUSED(connection);
+#endif
+    return QDBusVariant(data);
+}
+
+DBusMenuPayloadReader::DBusMenuPayloadReader(const QVariant &payload)
+: m_valid(false)
+, m_address(0)
+, m_size(0)
+{
+    if (payload.type() == QVariant::ByteArray) {
+        m_data = payload.toByteArray();
+        m_valid = true;
+        return;
+    }
+
+#ifdef HAVE_MEMFD_CREATE
+    if (payload.userType() == qMetaTypeId<QDBusUnixFileDescriptor>()) {
+        QDBusUnixFileDescriptor descriptor = payload.value<QDBusUnixFileDescriptor>();
+        int fd = descriptor.fileDescriptor();
+
+        int seals = fcntl(fd, F_GET_SEALS);
+        if (seals == -1 || (seals & REQUIRED_SEALS) != REQUIRED_SEALS) {
+            DMWARNING << "Refusing to map a layout file descriptor which is not sealed";
+            return;
+        }
+        struct stat info;
+        if (fstat(fd, &info) == -1) {
+            DMWARNING << "Could not stat layout file descriptor:" << strerror(errno);
+            return;
+        }
+        m_size = info.st_size;
+        if (m_size > 0) {
+            void *address = mmap(0, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (address == MAP_FAILED) {
+                DMWARNING << "Could not map layout file descriptor:" << strerror(errno);
+                return;
+            }
+            m_address = address;
+            m_data = QByteArray::fromRawData(static_cast<const char *>(m_address), m_size);
+        }
+        m_valid = true;
+        return;
+    }
+#endif
+
+    DMWARNING << "Unsupported layout payload of type" << payload.typeName();
+}
+
+DBusMenuPayloadReader::~DBusMenuPayloadReader()
+{
+    m_data.clear();
+#ifdef HAVE_MEMFD_CREATE
+    if (m_address) {
+        munmap(m_address, m_size);
+    }
+#endif
+}
+
+bool DBusMenuPayloadReader::isValid() const
+{
+    return m_valid;
+}
+
+const QByteArray &DBusMenuPayloadReader::data() const
+{
+    return m_data;
+}
@@ -0,0 +1,67 @@
+/* This file is part of the dbusmenu-qt library
+   Copyright 2010 Canonical
+   Author: Aurelien Gateau <aurelien.gateau@canonical.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License (LGPL) as published by the Free Software Foundation;
+   either version 2 of the License, or (at your option) any later
+   version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+#ifndef DBUSMENUPAYLOAD_P_H
+#define DBUSMENUPAYLOAD_P_H
+
+// Qt
+#include <QtCore/QByteArray>
+#include <QtCore/QVariant>
+#include <QtDBus/QDBusVariant>
+
+// Local
+#include <dbusmenu_export.h>
+
+class QDBusConnection;
+
+struct DBusMenuLayoutItem;
+
+/**
+ * Serializes item for GetLayoutFd(). If the result is large and connection
+ * can pass file descriptors, it is written to a sealed memfd and the variant
+ * holds the file descriptor, otherwise the variant holds the bytes.
+ * @internal
+ */
+QDBusVariant DBusMenuPayload_fromLayout(const DBusMenuLayoutItem &item, const QDBusConnection &connection);
+
+/**
+ * Gives access to the bytes of a GetLayoutFd() payload. File descriptors are
+ * mapped read-only, so data() does not copy them. data() is only valid as
+ * long as the reader exists.
+ * @internal
+ */
+class DBUSMENU_EXPORT DBusMenuPayloadReader
+{
+public:
+    explicit DBusMenuPayloadReader(const QVariant &payload);
+    ~DBusMenuPayloadReader();
+
+    bool isValid() const;
+    const QByteArray &data() const;
+
+private:
+    Q_DISABLE_COPY(DBusMenuPayloadReader)
+    bool m_valid;
+    void *m_address;
+    size_t m_size;
+    QByteArray m_data;
+};
+
+#endif /* DBUSMENUPAYLOAD_P_H */
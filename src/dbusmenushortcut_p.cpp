@@ -21,6 +21,7 @@
 #include "dbusmenushortcut_p.h"
 
 // Qt
+#include <QtCore/QDataStream>
 #include <QtGui/QKeySequence>
 
 // Local
@@ -83,3 +84,13 @@ QKeySequence DBusMenuShortcut::toKeySequence() const
     QString string = tmp.join(QLatin1String(", "));
     return QKeySequence::fromString(string);
 }
+
+QDataStream &operator<<(QDataStream &stream, const DBusMenuShortcut &shortcut)
+{
+    return stream << static_cast<const QList<QStringList> &>(shortcut);
+}
+
+QDataStream &operator>>(QDataStream &stream, DBusMenuShortcut &shortcut)
+{
+    return stream >> static_cast<QList<QStringList> &>(shortcut);
+}
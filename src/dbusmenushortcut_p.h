@@ -29,6 +29,7 @@
 #include <dbusmenu_export.h>
 
 
+class QDataStream;
 class QKeySequence;
 
 class DBUSMENU_EXPORT DBusMenuShortcut : public QList<QStringList>
@@ -40,4 +41,7 @@ public:
 
 Q_DECLARE_METATYPE(DBusMenuShortcut)
 
+DBUSMENU_EXPORT QDataStream &operator<<(QDataStream &stream, const DBusMenuShortcut &);
+DBUSMENU_EXPORT QDataStream &operator>>(QDataStream &stream, DBusMenuShortcut &);
+
 #endif /* DBUSMENUSHORTCUT_H */
@@ -0,0 +1,217 @@
+/* This file is part of the dbusmenu-qt library
+   Copyright 2010 Canonical
+   Author: Aurelien Gateau <aurelien.gateau@canonical.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License (LGPL) as published by the Free Software Foundation;
+   either version 2 of the License, or (at your option) any later
+   version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+#include "dbusmenusignaldispatcher_p.h"
+
+// Qt
+#include <QDBusMessage>
+#include <QDBusPendingCallWatcher>
+#include <QDBusPendingReply>
+#include <QDBusServiceWatcher>
+#include <QSet>
+
+// Local
+#include "debug_p.h"
+
+static const char *DBUSMENU_INTERFACE = "com.canonical.dbusmenu";
+static const char *DBUSMENU_PROPERTY_SERVICE = "_dbusmenu_service";
+
+typedef QHash<QString, DBusMenuSignalDispatcher *> DispatcherForConnection;
+Q_GLOBAL_STATIC(DispatcherForConnection, dispatcherForConnection)
+
+static QString routeKey(const QString &owner, const QString &path)
+{
+    return owner + QLatin1Char(' ') + path;
+}
+
+static bool isUniqueName(const QString &service)
+{
+    return service.isEmpty() || service.startsWith(QLatin1Char(':'));
+}
+
+DBusMenuSignalDispatcher *DBusMenuSignalDispatcher::instance(const QDBusConnection &connection)
+{
+    DBusMenuSignalDispatcher *dispatcher = dispatcherForConnection()->value(connection.name());
+    if (!dispatcher) {
+        dispatcher = new DBusMenuSignalDispatcher(connection);
+        dispatcherForConnection()->insert(connection.name(), dispatcher);
+    }
+    return dispatcher;
+}
+
+DBusMenuSignalDispatcher::DBusMenuSignalDispatcher(const QDBusConnection &connection)
+: m_connection(connection)
+, m_serviceWatcher(new QDBusServiceWatcher(QString(), connection, QDBusServiceWatcher::WatchForOwnerChange, this))
+{
+    // An empty signal name installs a single match rule for the whole
+    // interface, whatever the sender and the path
+    m_connection.connect(QString(), QString(), DBUSMENU_INTERFACE, QString(),
+        this, SLOT(dispatchSignal(QDBusMessage)));
+    connect(m_serviceWatcher, SIGNAL(serviceOwnerChanged(QString, QString, QString)),
+        SLOT(slotServiceOwnerChanged(QString, QString, QString)));
+}
+
+DBusMenuSignalDispatcher::~DBusMenuSignalDispatcher()
+{
+    m_connection.disconnect(QString(), QString(), DBUSMENU_INTERFACE, QString(),
+        this, SLOT(dispatchSignal(QDBusMessage)));
+}
+
+void DBusMenuSignalDispatcher::addReceiver(DBusMenuSignalReceiver *receiver, const QString &service, const QString &path)
+{
+    DMRETURN_IF_FAIL(!m_routeForReceiver.contains(receiver));
+    Route route;
+    route.service = service;
+    route.path = path;
+    if (isUniqueName(service)) {
+        route.owner = service;
+    } else {
+        // Watch the name before asking for its owner, so that no change can
+        // be missed in between
+        m_serviceWatcher->addWatchedService(service);
+
+        // Signals are sent by the unique name of the owner, find it out
+        // without blocking
+        QDBusMessage message = QDBusMessage::createMethodCall("org.freedesktop.DBus", "/org/freedesktop/DBus",
+            "org.freedesktop.DBus", "GetNameOwner");
+        message << service;
+        QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(m_connection.asyncCall(message), this);
+        watcher->setProperty(DBUSMENU_PROPERTY_SERVICE, service);
+        connect(watcher, SIGNAL(finished(QDBusPendingCallWatcher*)),
+            SLOT(slotGetNameOwnerFinished(QDBusPendingCallWatcher*)));
+    }
+    m_routeForReceiver.insert(receiver, route);
+    addRoute(receiver);
+}
+
+void DBusMenuSignalDispatcher::removeReceiver(DBusMenuSignalReceiver *receiver)
+{
+    removeRoute(receiver);
+    m_routeForReceiver.remove(receiver);
+    // Not right away: the receiver may be registered again, for example
+    // when an importer is rebound
+    if (m_routeForReceiver.isEmpty()) {
+        QMetaObject::invokeMethod(this, "deleteIfUnused", Qt::QueuedConnection);
+    } else {
+        QMetaObject::invokeMethod(this, "unwatchUnusedServices", Qt::QueuedConnection);
+    }
+}
+
+void DBusMenuSignalDispatcher::unwatchUnusedServices()
+{
+    QSet<QString> usedServices;
+    Q_FOREACH(const Route &route, m_routeForReceiver) {
+        usedServices << route.service;
+    }
+    Q_FOREACH(const QString &service, m_serviceWatcher->watchedServices()) {
+        if (!usedServices.contains(service)) {
+            m_serviceWatcher->removeWatchedService(service);
+        }
+    }
+}
+
+void DBusMenuSignalDispatcher::deleteIfUnused()
+{
+    if (!m_routeForReceiver.isEmpty()) {
+        return;
+    }
+    if (dispatcherForConnection()->value(m_connection.name()) == this) {
+        dispatcherForConnection()->remove(m_connection.name());
+    }
+    deleteLater();
+}
+
+void DBusMenuSignalDispatcher::setOwner(DBusMenuSignalReceiver *receiver, const QString &owner)
+{
+    QHash<DBusMenuSignalReceiver *, Route>::Iterator it = m_routeForReceiver.find(receiver);
+    if (it == m_routeForReceiver.end() || it->owner == owner || isUniqueName(it->service)) {
+        return;
+    }
+    removeRoute(receiver);
+    it->owner = owner;
+    addRoute(receiver);
+}
+
+void DBusMenuSignalDispatcher::addRoute(DBusMenuSignalReceiver *receiver)
+{
+    const Route &route = m_routeForReceiver[receiver];
+    if (!route.owner.isEmpty() || route.service.isEmpty()) {
+        m_receiversForKey.insert(routeKey(route.owner, route.path), receiver);
+    }
+}
+
+void DBusMenuSignalDispatcher::removeRoute(DBusMenuSignalReceiver *receiver)
+{
+    QHash<DBusMenuSignalReceiver *, Route>::ConstIterator it = m_routeForReceiver.constFind(receiver);
+    if (it != m_routeForReceiver.constEnd()) {
+        m_receiversForKey.remove(routeKey(it->owner, it->path), receiver);
+    }
+}
+
+void DBusMenuSignalDispatcher::slotGetNameOwnerFinished(QDBusPendingCallWatcher *watcher)
+{
+    QString service = watcher->property(DBUSMENU_PROPERTY_SERVICE).toString();
+    watcher->deleteLater();
+    QDBusPendingReply<QString> reply = *watcher;
+    if (reply.isError()) {
+        // Not running yet, replies will tell the owner
+        return;
+    }
+    Q_FOREACH(DBusMenuSignalReceiver *receiver, m_routeForReceiver.keys()) {
+        if (m_routeForReceiver.value(receiver).service == service) {
+            setOwner(receiver, reply.value());
+        }
+    }
+}
+
+void DBusMenuSignalDispatcher::slotServiceOwnerChanged(const QString &service, const QString &/*oldOwner*/, const QString &newOwner)
+{
+    QList<DBusMenuSignalReceiver *> receivers;
+    Q_FOREACH(DBusMenuSignalReceiver *receiver, m_routeForReceiver.keys()) {
+        if (m_routeForReceiver.value(receiver).service == service) {
+            setOwner(receiver, newOwner);
+            receivers << receiver;
+        }
+    }
+    if (newOwner.isEmpty()) {
+        // Gone: nothing to tell until it comes back
+        return;
+    }
+    Q_FOREACH(DBusMenuSignalReceiver *receiver, receivers) {
+        // A receiver can be removed or rebound by the handling of a change
+        QHash<DBusMenuSignalReceiver *, Route>::ConstIterator it = m_routeForReceiver.constFind(receiver);
+        if (it != m_routeForReceiver.constEnd() && it->service == service) {
+            receiver->handleOwnerChange(newOwner);
+        }
+    }
+}
+
+void DBusMenuSignalDispatcher::dispatchSignal(const QDBusMessage &message)
+{
+    QList<DBusMenuSignalReceiver *> receivers = m_receiversForKey.values(routeKey(message.service(), message.path()));
+    Q_FOREACH(DBusMenuSignalReceiver *receiver, receivers) {
+        // A receiver can be removed by the handling of a signal
+        if (m_routeForReceiver.contains(receiver)) {
+            receiver->handleSignal(message);
+        }
+    }
+}
+
+#include "dbusmenusignaldispatcher_p.moc"
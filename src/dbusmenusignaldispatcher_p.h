@@ -0,0 +1,120 @@
+/* This file is part of the dbusmenu-qt library
+   Copyright 2010 Canonical
+   Author: Aurelien Gateau <aurelien.gateau@canonical.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License (LGPL) as published by the Free Software Foundation;
+   either version 2 of the License, or (at your option) any later
+   version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+#ifndef DBUSMENUSIGNALDISPATCHER_P_H
+#define DBUSMENUSIGNALDISPATCHER_P_H
+
+// Qt
+#include <QtCore/QHash>
+#include <QtCore/QObject>
+#include <QtDBus/QDBusConnection>
+
+class QDBusMessage;
+class QDBusPendingCallWatcher;
+class QDBusServiceWatcher;
+
+/**
+ * Receives the signals of one exporter
+ * @internal
+ */
+class DBusMenuSignalReceiver
+{
+public:
+    virtual ~DBusMenuSignalReceiver() {}
+
+    virtual void handleSignal(const QDBusMessage &message) = 0;
+
+    /**
+     * Called when the well-known service name of the receiver gets a new
+     * owner, for example because the exporter restarted
+     */
+    virtual void handleOwnerChange(const QString &owner) = 0;
+};
+
+/**
+ * Listens to the signals of all the exporters of a connection with a single
+ * match rule, and hands each of them to the receivers registered for its
+ * sender and path. This way, the bus daemon does not have to check one set
+ * of match rules per importer for every message.
+ *
+ * The owners of well-known service names are followed with a single
+ * QDBusServiceWatcher, so that signals keep reaching their receivers when an
+ * exporter restarts or appears after its importers.
+ * @internal
+ */
+class DBusMenuSignalDispatcher : public QObject
+{
+    Q_OBJECT
+public:
+    /**
+     * Returns the dispatcher of connection, creating it if necessary
+     */
+    static DBusMenuSignalDispatcher *instance(const QDBusConnection &connection);
+
+    /**
+     * receiver gets the signals emitted by the object at path of service.
+     * service may be a well-known name, it must be empty for peer-to-peer
+     * connections.
+     */
+    void addReceiver(DBusMenuSignalReceiver *receiver, const QString &service, const QString &path);
+
+    /**
+     * Must be called before receiver is deleted. The dispatcher deletes
+     * itself once it has no receivers left.
+     */
+    void removeReceiver(DBusMenuSignalReceiver *receiver);
+
+    /**
+     * Tells the unique name of the current owner of the service of receiver,
+     * for example when a reply comes from it
+     */
+    void setOwner(DBusMenuSignalReceiver *receiver, const QString &owner);
+
+private Q_SLOTS:
+    void dispatchSignal(const QDBusMessage &message);
+    void slotGetNameOwnerFinished(QDBusPendingCallWatcher *watcher);
+    void slotServiceOwnerChanged(const QString &service, const QString &oldOwner, const QString &newOwner);
+    void unwatchUnusedServices();
+    void deleteIfUnused();
+
+private:
+    explicit DBusMenuSignalDispatcher(const QDBusConnection &connection);
+    ~DBusMenuSignalDispatcher();
+
+    struct Route
+    {
+        QString service;
+        QString path;
+        // Unique name of the sender of the signals, empty until known for a
+        // well-known service name
+        QString owner;
+    };
+
+    void addRoute(DBusMenuSignalReceiver *receiver);
+    void removeRoute(DBusMenuSignalReceiver *receiver);
+
+    QDBusConnection m_connection;
+    QDBusServiceWatcher *m_serviceWatcher;
+    QHash<DBusMenuSignalReceiver *, Route> m_routeForReceiver;
+    // Receivers by owner and path
+    QMultiHash<QString, DBusMenuSignalReceiver *> m_receiversForKey;
+};
+
+#endif /* DBUSMENUSIGNALDISPATCHER_P_H */
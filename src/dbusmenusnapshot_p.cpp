@@ -0,0 +1,267 @@
+/* This file is part of the dbusmenu-qt library
+   Copyright 2010 Canonical
+   Author: Aurelien Gateau <aurelien.gateau@canonical.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License (LGPL) as published by the Free Software Foundation;
+   either version 2 of the License, or (at your option) any later
+   version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+#include "dbusmenusnapshot_p.h"
+
+// Qt
+#include <QDBusConnection>
+#include <QDBusError>
+#include <QDBusMessage>
+#include <QMutexLocker>
+#include <QSet>
+
+// Local
+#include "dbusmenuexporterdbus_p.h"
+#include "dbusmenupayload_p.h"
+#include "debug_p.h"
+
+static const char *ICON_DATA_HASH_PROPERTY = "x-qt-icon-data-hash";
+
+//-------------------------------------------------
+//
+// DBusMenuSnapshot
+//
+//-------------------------------------------------
+QVariantMap DBusMenuSnapshot::properties(int id, const QStringList &names) const
+{
+    QHash<int, Item>::ConstIterator it = items.constFind(id);
+    DMRETURN_VALUE_IF_FAIL(it != items.constEnd(), QVariantMap());
+    const QVariantMap &all = it.value().properties;
+    if (names.isEmpty()) {
+        if (!all.contains(ICON_DATA_HASH_PROPERTY)) {
+            return all;
+        }
+        // The hash is only sent to clients asking for it
+        QVariantMap map = all;
+        map.remove(ICON_DATA_HASH_PROPERTY);
+        return map;
+    }
+    QVariantMap map;
+    Q_FOREACH(const QString &name, names) {
+        QVariant value = all.value(name);
+        if (value.isValid()) {
+            map.insert(name, value);
+        }
+    }
+    return map;
+}
+
+void DBusMenuSnapshot::fillLayoutItem(DBusMenuLayoutItem *item, int id, int depth, const QStringList &names) const
+{
+    item->id = id;
+    item->properties = properties(id, names);
+
+    if (depth != 0) {
+        Q_FOREACH(int childId, items.value(id).children) {
+            DBusMenuLayoutItem child;
+            fillLayoutItem(&child, childId, depth - 1, names);
+            item->children << child;
+        }
+    }
+}
+
+//-------------------------------------------------
+//
+// DBusMenuSnapshotDBus
+//
+//-------------------------------------------------
+DBusMenuSnapshotDBus::DBusMenuSnapshotDBus(DBusMenuExporterDBus *exporterDBus)
+: QObject()
+, m_exporterDBus(exporterDBus)
+, m_status(exporterDBus->status())
+, m_peerAddress(exporterDBus->GetPeerAddress())
+, m_layoutFdEnabled(exporterDBus->qtExtensions().contains("layout-fd"))
+{
+    DBusMenuTypes_register();
+    qRegisterMetaType<QDBusMessage>("QDBusMessage");
+
+    // Signals are emitted from the GUI thread, relay them through this
+    // object, which is the one registered on the bus
+    connect(exporterDBus, SIGNAL(ItemsPropertiesUpdated(DBusMenuItemList, DBusMenuItemKeysList)),
+        SIGNAL(ItemsPropertiesUpdated(DBusMenuItemList, DBusMenuItemKeysList)), Qt::DirectConnection);
+    connect(exporterDBus, SIGNAL(LayoutUpdated(uint, int)),
+        SIGNAL(LayoutUpdated(uint, int)), Qt::DirectConnection);
+    connect(exporterDBus, SIGNAL(ItemActivationRequested(int, uint)),
+        SIGNAL(ItemActivationRequested(int, uint)), Qt::DirectConnection);
+}
+
+uint DBusMenuSnapshotDBus::Version() const
+{
+    return m_exporterDBus->Version();
+}
+
+QString DBusMenuSnapshotDBus::status() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_status;
+}
+
+void DBusMenuSnapshotDBus::setStatus(const QString &status)
+{
+    QMutexLocker locker(&m_mutex);
+    m_status = status;
+}
+
+void DBusMenuSnapshotDBus::setPeerAddress(const QString &address)
+{
+    QMutexLocker locker(&m_mutex);
+    m_peerAddress = address;
+}
+
+QString DBusMenuSnapshotDBus::GetPeerAddress()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_peerAddress;
+}
+
+QStringList DBusMenuSnapshotDBus::qtExtensions() const
+{
+    QMutexLocker locker(&m_mutex);
+    QStringList list;
+    list << "icon-data-hash";
+    if (m_layoutFdEnabled) {
+        list << "layout-fd";
+    }
+    if (!m_peerAddress.isEmpty()) {
+        list << "peer-to-peer";
+    }
+    return list;
+}
+
+void DBusMenuSnapshotDBus::setLayoutFdEnabled(bool enabled)
+{
+    QMutexLocker locker(&m_mutex);
+    m_layoutFdEnabled = enabled;
+}
+
+void DBusMenuSnapshotDBus::setSnapshot(const DBusMenuSnapshotPointer &snapshot)
+{
+    QMutexLocker locker(&m_mutex);
+    m_snapshot = snapshot;
+}
+
+DBusMenuSnapshotPointer DBusMenuSnapshotDBus::snapshot() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_snapshot;
+}
+
+uint DBusMenuSnapshotDBus::GetLayout(int parentId, int recursionDepth, const QStringList &propertyNames, DBusMenuLayoutItem &item)
+{
+    DBusMenuSnapshotPointer current = snapshot();
+    DMRETURN_VALUE_IF_FAIL(current->items.contains(parentId), 0);
+
+    current->fillLayoutItem(&item, parentId, recursionDepth, propertyNames);
+    return current->revision;
+}
+
+uint DBusMenuSnapshotDBus::GetLayoutFd(int parentId, int recursionDepth, const QStringList &propertyNames, QDBusVariant &layout)
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        if (!m_layoutFdEnabled) {
+            sendErrorReply(QDBusError::NotSupported, "Passing layouts as file descriptors is not enabled");
+            return 0;
+        }
+    }
+    DBusMenuLayoutItem item;
+    uint revision = GetLayout(parentId, recursionDepth, propertyNames, item);
+    layout = DBusMenuPayload_fromLayout(item, connection());
+    return revision;
+}
+
+QVariantMap DBusMenuSnapshotDBus::GetIcons(const QStringList &hashes)
+{
+    DBusMenuSnapshotPointer current = snapshot();
+    QSet<QString> wanted = hashes.toSet();
+    QVariantMap map;
+    Q_FOREACH(const DBusMenuSnapshot::Item &item, current->items) {
+        QString hash = item.properties.value(ICON_DATA_HASH_PROPERTY).toString();
+        if (!hash.isEmpty() && wanted.remove(hash)) {
+            map.insert(hash, item.properties.value("icon-data"));
+            if (wanted.isEmpty()) {
+                break;
+            }
+        }
+    }
+    return map;
+}
+
+QDBusVariant DBusMenuSnapshotDBus::GetProperty(int id, const QString &name)
+{
+    DBusMenuSnapshotPointer current = snapshot();
+    DMRETURN_VALUE_IF_FAIL(current->items.contains(id), QDBusVariant());
+    return QDBusVariant(current->items.value(id).properties.value(name));
+}
+
+DBusMenuItemList DBusMenuSnapshotDBus::GetGroupProperties(const QList<int> &ids, const QStringList &names)
+{
+    DBusMenuSnapshotPointer current = snapshot();
+    DBusMenuItemList list;
+    Q_FOREACH(int id, ids) {
+        DBusMenuItem item;
+        item.id = id;
+        item.properties = current->properties(id, names);
+        list << item;
+    }
+    return list;
+}
+
+void DBusMenuSnapshotDBus::Event(int id, const QString &eventId, const QDBusVariant &data, uint timestamp)
+{
+    QMetaObject::invokeMethod(m_exporterDBus, "Event", Qt::QueuedConnection,
+        Q_ARG(int, id), Q_ARG(QString, eventId), Q_ARG(QDBusVariant, data), Q_ARG(uint, timestamp));
+}
+
+bool DBusMenuSnapshotDBus::AboutToShow(int id)
+{
+    // aboutToShow() handlers must run in the GUI thread: answer from there
+    setDelayedReply(true);
+    QMetaObject::invokeMethod(m_exporterDBus, "replyToAboutToShow", Qt::QueuedConnection,
+        Q_ARG(int, id), Q_ARG(QDBusMessage, message()), Q_ARG(QString, connection().name()));
+    return false;
+}
+
+QList<int> DBusMenuSnapshotDBus::EventGroup(const DBusMenuEventList &events)
+{
+    DBusMenuSnapshotPointer current = snapshot();
+    QList<int> idErrors;
+    Q_FOREACH(const DBusMenuEvent &event, events) {
+        if (!current->items.contains(event.id)) {
+            idErrors << event.id;
+            continue;
+        }
+        Event(event.id, event.eventId, event.data, event.timestamp);
+    }
+    if (!events.isEmpty() && idErrors.count() == events.count()) {
+        sendErrorReply(QDBusError::InvalidArgs, "None of the ids could be found");
+    }
+    return idErrors;
+}
+
+QList<int> DBusMenuSnapshotDBus::AboutToShowGroup(const QList<int> &ids, QList<int> &/*idErrors*/)
+{
+    setDelayedReply(true);
+    QMetaObject::invokeMethod(m_exporterDBus, "replyToAboutToShowGroup", Qt::QueuedConnection,
+        Q_ARG(QList<int>, ids), Q_ARG(QDBusMessage, message()), Q_ARG(QString, connection().name()));
+    return QList<int>();
+}
+
+#include "dbusmenusnapshot_p.moc"
@@ -0,0 +1,119 @@
+/* This file is part of the dbusmenu-qt library
+   Copyright 2010 Canonical
+   Author: Aurelien Gateau <aurelien.gateau@canonical.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License (LGPL) as published by the Free Software Foundation;
+   either version 2 of the License, or (at your option) any later
+   version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+#ifndef DBUSMENUSNAPSHOT_P_H
+#define DBUSMENUSNAPSHOT_P_H
+
+// Local
+#include <dbusmenutypes_p.h>
+
+// Qt
+#include <QtCore/QHash>
+#include <QtCore/QMutex>
+#include <QtCore/QObject>
+#include <QtCore/QSharedPointer>
+#include <QtCore/QVariant>
+#include <QtDBus/QDBusContext>
+#include <QtDBus/QDBusVariant>
+
+class DBusMenuExporterDBus;
+
+/**
+ * Immutable copy of the menu tree exported by DBusMenuExporter. Once created,
+ * it is never modified, so it can be read from any thread.
+ * @internal
+ */
+class DBusMenuSnapshot
+{
+public:
+    struct Item
+    {
+        QVariantMap properties;
+        QList<int> children;
+    };
+
+    uint revision;
+    QHash<int, Item> items;
+
+    QVariantMap properties(int id, const QStringList &names) const;
+    void fillLayoutItem(DBusMenuLayoutItem *item, int id, int depth, const QStringList &names) const;
+};
+
+typedef QSharedPointer<const DBusMenuSnapshot> DBusMenuSnapshotPointer;
+
+/**
+ * Internal class answering the read-only methods of the DBusMenu spec from
+ * a DBusMenuSnapshot. It lives in its own thread so that these methods can be
+ * answered while the GUI thread is busy. Other methods are forwarded to the
+ * DBusMenuExporterDBus instance living in the GUI thread.
+ * @internal
+ */
+class DBusMenuSnapshotDBus : public QObject, protected QDBusContext
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", "com.canonical.dbusmenu")
+    Q_PROPERTY(uint Version READ Version)
+    Q_PROPERTY(QString Status READ status)
+    Q_PROPERTY(QStringList QtExtensions READ qtExtensions)
+public:
+    DBusMenuSnapshotDBus(DBusMenuExporterDBus *exporterDBus);
+
+    uint Version() const;
+
+    QString status() const;
+    void setStatus(const QString &status);
+
+    void setPeerAddress(const QString &address);
+
+    QStringList qtExtensions() const;
+    void setLayoutFdEnabled(bool enabled);
+
+    void setSnapshot(const DBusMenuSnapshotPointer &snapshot);
+
+public Q_SLOTS:
+    Q_NOREPLY void Event(int id, const QString &eventId, const QDBusVariant &data, uint timestamp);
+    QDBusVariant GetProperty(int id, const QString &property);
+    uint GetLayout(int parentId, int recursionDepth, const QStringList &propertyNames, DBusMenuLayoutItem &item);
+    DBusMenuItemList GetGroupProperties(const QList<int> &ids, const QStringList &propertyNames);
+    bool AboutToShow(int id);
+    QList<int> EventGroup(const DBusMenuEventList &events);
+    QList<int> AboutToShowGroup(const QList<int> &ids, QList<int> &idErrors);
+    QString GetPeerAddress();
+    uint GetLayoutFd(int parentId, int recursionDepth, const QStringList &propertyNames, QDBusVariant &layout);
+    QVariantMap GetIcons(const QStringList &hashes);
+
+Q_SIGNALS:
+    void ItemsPropertiesUpdated(DBusMenuItemList, DBusMenuItemKeysList);
+    void LayoutUpdated(uint revision, int parentId);
+    void ItemActivationRequested(int id, uint timeStamp);
+
+private:
+    DBusMenuExporterDBus *m_exporterDBus;
+
+    mutable QMutex m_mutex;
+    DBusMenuSnapshotPointer m_snapshot;
+    QString m_status;
+    QString m_peerAddress;
+    bool m_layoutFdEnabled;
+
+    DBusMenuSnapshotPointer snapshot() const;
+};
+
+#endif /* DBUSMENUSNAPSHOT_P_H */
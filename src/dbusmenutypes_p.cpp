@@ -25,6 +25,7 @@
 #include <debug_p.h>
 
 // Qt
+#include <QDataStream>
 #include <QDBusArgument>
 #include <QDBusMetaType>
 
@@ -86,15 +87,99 @@ const QDBusArgument &operator>>(const QDBusArgument &argument, DBusMenuLayoutIte
         argument >> dbusVariant;
         QDBusArgument childArgument = dbusVariant.variant().value<QDBusArgument>();
 
-        DBusMenuLayoutItem child;
-        childArgument >> child;
-        obj.children.append(child);
+        // Decode in place to avoid copying the child subtree
+        obj.children.append(DBusMenuLayoutItem());
+        childArgument >> obj.children.last();
     }
     argument.endArray();
     argument.endStructure();
     return argument;
 }
 
+//// DBusMenuEvent
+QDBusArgument &operator<<(QDBusArgument &argument, const DBusMenuEvent &obj)
+{
+    argument.beginStructure();
+    argument << obj.id << obj.eventId << obj.data << obj.timestamp;
+    argument.endStructure();
+    return argument;
+}
+
+const QDBusArgument &operator>>(const QDBusArgument &argument, DBusMenuEvent &obj)
+{
+    argument.beginStructure();
+    argument >> obj.id >> obj.eventId >> obj.data >> obj.timestamp;
+    argument.endStructure();
+    return argument;
+}
+
+static void readLayoutItem(const QDBusArgument &argument, DBusMenuLayoutVisitor *visitor, int depth)
+{
+    int id;
+    QVariantMap properties;
+    argument.beginStructure();
+    argument >> id >> properties;
+    visitor->beginItem(id, properties, depth);
+    argument.beginArray();
+    while (!argument.atEnd()) {
+        QDBusVariant dbusVariant;
+        argument >> dbusVariant;
+        // The QDBusArgument shares the reply data, it does not copy it
+        QDBusArgument childArgument = dbusVariant.variant().value<QDBusArgument>();
+        readLayoutItem(childArgument, visitor, depth + 1);
+    }
+    argument.endArray();
+    argument.endStructure();
+    visitor->endItem(id, depth);
+}
+
+void DBusMenuTypes_readLayout(const QDBusArgument &argument, DBusMenuLayoutVisitor *visitor)
+{
+    readLayoutItem(argument, visitor, 0);
+}
+
+// Layout streams must not depend on the Qt versions of both sides
+static const int LAYOUT_STREAM_VERSION = QDataStream::Qt_4_6;
+
+static void writeLayoutItem(QDataStream &stream, const DBusMenuLayoutItem &item)
+{
+    stream << qint32(item.id) << item.properties << quint32(item.children.count());
+    Q_FOREACH(const DBusMenuLayoutItem &child, item.children) {
+        writeLayoutItem(stream, child);
+    }
+}
+
+void DBusMenuTypes_writeLayout(QDataStream &stream, const DBusMenuLayoutItem &item)
+{
+    stream.setVersion(LAYOUT_STREAM_VERSION);
+    writeLayoutItem(stream, item);
+}
+
+static bool readLayoutItem(QDataStream &stream, DBusMenuLayoutVisitor *visitor, int depth)
+{
+    qint32 id;
+    QVariantMap properties;
+    quint32 childCount;
+    stream >> id >> properties >> childCount;
+    if (stream.status() != QDataStream::Ok) {
+        return false;
+    }
+    visitor->beginItem(id, properties, depth);
+    for (quint32 pos = 0; pos < childCount; ++pos) {
+        if (!readLayoutItem(stream, visitor, depth + 1)) {
+            return false;
+        }
+    }
+    visitor->endItem(id, depth);
+    return true;
+}
+
+bool DBusMenuTypes_readLayout(QDataStream &stream, DBusMenuLayoutVisitor *visitor)
+{
+    stream.setVersion(LAYOUT_STREAM_VERSION);
+    return readLayoutItem(stream, visitor, 0);
+}
+
 void DBusMenuTypes_register()
 {
     static bool registered = false;
@@ -107,6 +192,10 @@ void DBusMenuTypes_register()
     qDBusRegisterMetaType<DBusMenuItemKeysList>();
     qDBusRegisterMetaType<DBusMenuLayoutItem>();
     qDBusRegisterMetaType<DBusMenuLayoutItemList>();
+    qDBusRegisterMetaType<DBusMenuEvent>();
+    qDBusRegisterMetaType<DBusMenuEventList>();
     qDBusRegisterMetaType<DBusMenuShortcut>();
+    // Needed to pass shortcuts in layout streams
+    qRegisterMetaTypeStreamOperators<DBusMenuShortcut>("DBusMenuShortcut");
     registered = true;
 }
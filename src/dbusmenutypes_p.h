@@ -25,10 +25,12 @@
 #include <QtCore/QList>
 #include <QtCore/QStringList>
 #include <QtCore/QVariant>
+#include <QtDBus/QDBusVariant>
 
 // Local
 #include <dbusmenu_export.h>
 
+class QDataStream;
 class QDBusArgument;
 
 //// DBusMenuItem
@@ -92,5 +94,69 @@ typedef QList<DBusMenuLayoutItem> DBusMenuLayoutItemList;
 
 Q_DECLARE_METATYPE(DBusMenuLayoutItemList)
 
+//// DBusMenuEvent
+/**
+ * An event sent with EventGroup()
+ */
+struct DBUSMENU_EXPORT DBusMenuEvent
+{
+    int id;
+    QString eventId;
+    QDBusVariant data;
+    uint timestamp;
+};
+
+Q_DECLARE_METATYPE(DBusMenuEvent)
+
+DBUSMENU_EXPORT QDBusArgument &operator<<(QDBusArgument &argument, const DBusMenuEvent &);
+DBUSMENU_EXPORT const QDBusArgument &operator>>(const QDBusArgument &argument, DBusMenuEvent &);
+
+typedef QList<DBusMenuEvent> DBusMenuEventList;
+
+Q_DECLARE_METATYPE(DBusMenuEventList)
+
+// Used for lists of ids
+Q_DECLARE_METATYPE(QList<int>)
+
+/**
+ * Receives the items of a serialized DBusMenuLayoutItem, in document order,
+ * as DBusMenuTypes_readLayout() walks it. This makes it possible to process a
+ * GetLayout() reply without building an intermediate DBusMenuLayoutItem tree.
+ */
+class DBusMenuLayoutVisitor
+{
+public:
+    virtual ~DBusMenuLayoutVisitor() {}
+
+    /**
+     * Called when an item is reached, before its children. The root item has
+     * a depth of 0.
+     */
+    virtual void beginItem(int id, const QVariantMap &properties, int depth) = 0;
+
+    /**
+     * Called once all the children of the item have been visited
+     */
+    virtual void endItem(int /*id*/, int /*depth*/) {}
+};
+
+/**
+ * Writes item and its children to stream, in the format read by
+ * DBusMenuTypes_readLayout(QDataStream &, DBusMenuLayoutVisitor *). This
+ * format is used to pass layouts as file descriptors.
+ */
+DBUSMENU_EXPORT void DBusMenuTypes_writeLayout(QDataStream &stream, const DBusMenuLayoutItem &item);
+
+/**
+ * Returns false if stream does not contain a valid layout. Items visited
+ * before the error has been found are not rolled back.
+ */
+DBUSMENU_EXPORT bool DBusMenuTypes_readLayout(QDataStream &stream, DBusMenuLayoutVisitor *visitor);
+
+/**
+ * Walks the (ia{sv}av) structure in argument, calling visitor for each item
+ */
+void DBusMenuTypes_readLayout(const QDBusArgument &argument, DBusMenuLayoutVisitor *visitor);
+
 void DBusMenuTypes_register();
 #endif /* DBUSMENUTYPES_P_H */
@@ -21,6 +21,7 @@
 #include "utils_p.h"
 
 // Qt
+#include <QCryptographicHash>
 #include <QString>
 
 QString swapMnemonicChar(const QString &in, const char src, const char dst)
@@ -62,3 +63,8 @@ QString swapMnemonicChar(const QString &in, const char src, const char dst)
 
     return out;
 }
+
+QString iconDataHash(const QByteArray &data)
+{
+    return QString::fromLatin1(QCryptographicHash::hash(data, QCryptographicHash::Sha1).toHex());
+}
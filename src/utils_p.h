@@ -21,6 +21,7 @@
 #ifndef UTILS_P_H
 #define UTILS_P_H
 
+class QByteArray;
 class QString;
 
 /**
@@ -28,4 +29,10 @@ class QString;
  */
 QString swapMnemonicChar(const QString &in, const char src, const char dst);
 
+/**
+ * Content hash of icon data, used as the value of the x-qt-icon-data-hash
+ * property and as the key of GetIcons() results
+ */
+QString iconDataHash(const QByteArray &data);
+
 #endif /* UTILS_P_H */
@@ -24,13 +24,18 @@
 // Qt
 #include <QDBusConnection>
 #include <QDBusInterface>
+#include <QDBusMessage>
+#include <QDBusPendingCall>
 #include <QDBusReply>
 #include <QIcon>
 #include <QMenu>
+#include <QThread>
+#include <QTime>
 #include <QtTest>
 
 // DBusMenuQt
 #include <dbusmenuexporter.h>
+#include <dbusmenupayload_p.h>
 #include <dbusmenutypes_p.h>
 #include <dbusmenushortcut_p.h>
 #include <debug_p.h>
@@ -43,7 +48,7 @@ QTEST_MAIN(DBusMenuExporterTest)
 static const char *TEST_SERVICE = "org.kde.dbusmenu-qt-test";
 static const char *TEST_OBJECT_PATH = "/TestMenuBar";
 
-Q_DECLARE_METATYPE(QList<int>)
+Q_DECLARE_METATYPE(QMenu*)
 
 static DBusMenuLayoutItemList getChildren(QDBusAbstractInterface* iface, int parentId, const QStringList &propertyNames)
 {
@@ -58,6 +63,85 @@ static DBusMenuLayoutItemList getChildren(QDBusAbstractInterface* iface, int par
     return rootItem.children;
 }
 
+// Calls made on the connection which registered TEST_SERVICE are delivered
+// locally, which supports neither delayed replies nor objects living in
+// another thread. The following helpers go through the bus daemon instead.
+static const char *CLIENT_CONNECTION_NAME = "dbusmenuexportertest-client";
+
+static QDBusConnection clientConnection()
+{
+    return QDBusConnection::connectToBus(QDBusConnection::SessionBus, CLIENT_CONNECTION_NAME);
+}
+
+static QDBusMessage createCall(const QString &method, const QVariantList &arguments)
+{
+    QDBusMessage message = QDBusMessage::createMethodCall(TEST_SERVICE, TEST_OBJECT_PATH, "com.canonical.dbusmenu", method);
+    message.setArguments(arguments);
+    return message;
+}
+
+static QDBusPendingCall asyncCallThroughBus(const QString &method, const QVariantList &arguments = QVariantList())
+{
+    return clientConnection().asyncCall(createCall(method, arguments));
+}
+
+/**
+ * Runs the event loop until call is finished, returns its reply
+ */
+static QDBusMessage waitForReply(QDBusPendingCall call, int timeout = 5000)
+{
+    QTime time;
+    time.start();
+    while (!call.isFinished() && time.elapsed() < timeout) {
+        QTest::qWait(10);
+    }
+    return call.reply();
+}
+
+static QDBusMessage callThroughBus(const QString &method, const QVariantList &arguments = QVariantList())
+{
+    return waitForReply(asyncCallThroughBus(method, arguments));
+}
+
+static DBusMenuLayoutItemList getChildrenThroughBus(int parentId, const QStringList &propertyNames)
+{
+    QDBusMessage reply = callThroughBus("GetLayout", QVariantList() << parentId << /*recursionDepth=*/ 1 << propertyNames);
+    if (reply.type() != QDBusMessage::ReplyMessage) {
+        qFatal("%s", qPrintable(reply.errorMessage()));
+        return DBusMenuLayoutItemList();
+    }
+    return qdbus_cast<DBusMenuLayoutItem>(reply.arguments().at(1)).children;
+}
+
+/**
+ * Calls GetLayout() from a thread of its own, with a connection of its own,
+ * so that the call can be made while the main thread is busy
+ */
+class BlockingLayoutCaller : public QThread
+{
+public:
+    BlockingLayoutCaller()
+    : m_elapsed(-1)
+    {}
+
+    QDBusMessage m_reply;
+    int m_elapsed;
+
+protected:
+    void run()
+    {
+        const QString name = "dbusmenuexportertest-blocking-caller";
+        {
+            QDBusConnection connection = QDBusConnection::connectToBus(QDBusConnection::SessionBus, name);
+            QTime time;
+            time.start();
+            m_reply = connection.call(createCall("GetLayout", QVariantList() << 0 << -1 << QStringList()), QDBus::Block, 5000);
+            m_elapsed = time.elapsed();
+        }
+        QDBusConnection::disconnectFromBus(name);
+    }
+};
+
 void DBusMenuExporterTest::init()
 {
     QVERIFY(QDBusConnection::sessionBus().registerService(TEST_SERVICE));
@@ -213,6 +297,147 @@ void DBusMenuExporterTest::testClickedEvent()
     QCOMPARE(spy.count(), 1);
 }
 
+void DBusMenuExporterTest::testEventGroup()
+{
+    QMenu inputMenu;
+    QAction *a1 = inputMenu.addAction("a1");
+    QAction *a2 = inputMenu.addAction("a2");
+    QSignalSpy spy1(a1, SIGNAL(triggered()));
+    QSignalSpy spy2(a2, SIGNAL(triggered()));
+    DBusMenuExporter exporter(TEST_OBJECT_PATH, &inputMenu);
+
+    QDBusInterface iface(TEST_SERVICE, TEST_OBJECT_PATH);
+    DBusMenuLayoutItemList list = getChildren(&iface, 0, QStringList());
+    QCOMPARE(list.count(), 2);
+
+    const int invalidId = 12345;
+    DBusMenuEventList events;
+    Q_FOREACH(int id, QList<int>() << list.at(0).id << list.at(1).id << invalidId) {
+        DBusMenuEvent event;
+        event.id = id;
+        event.eventId = "clicked";
+        event.data = QDBusVariant(QString());
+        event.timestamp = QDateTime::currentDateTime().toTime_t();
+        events << event;
+    }
+    QDBusReply<QList<int> > reply = iface.call("EventGroup", QVariant::fromValue(events));
+    QVERIFY2(reply.isValid(), qPrintable(reply.error().message()));
+    QCOMPARE(reply.value(), QList<int>() << invalidId);
+    QTest::qWait(500);
+
+    QCOMPARE(spy1.count(), 1);
+    QCOMPARE(spy2.count(), 1);
+
+    // An error is returned if none of the ids can be found
+    events.removeFirst();
+    events.removeFirst();
+    reply = iface.call("EventGroup", QVariant::fromValue(events));
+    QVERIFY(!reply.isValid());
+}
+
+void DBusMenuExporterTest::testAboutToShowGroup()
+{
+    QMenu inputMenu;
+    QMenu *subMenu1 = inputMenu.addMenu("menu1");
+    QMenu *subMenu2 = inputMenu.addMenu("menu2");
+    subMenu1->addAction("a1");
+    subMenu2->addAction("a2");
+    QSignalSpy spy1(subMenu1, SIGNAL(aboutToShow()));
+    QSignalSpy spy2(subMenu2, SIGNAL(aboutToShow()));
+    DBusMenuExporter exporter(TEST_OBJECT_PATH, &inputMenu);
+
+    QDBusInterface iface(TEST_SERVICE, TEST_OBJECT_PATH);
+    DBusMenuLayoutItemList list = getChildren(&iface, 0, QStringList());
+    QCOMPARE(list.count(), 2);
+
+    const int invalidId = 12345;
+    QList<int> ids;
+    ids << list.at(0).id << list.at(1).id << invalidId;
+    QDBusMessage reply = iface.call("AboutToShowGroup", QVariant::fromValue(ids));
+    QCOMPARE(reply.type(), QDBusMessage::ReplyMessage);
+    QCOMPARE(reply.arguments().count(), 2);
+
+    QList<int> updatesNeeded = qdbus_cast<QList<int> >(reply.arguments().at(0));
+    QList<int> idErrors = qdbus_cast<QList<int> >(reply.arguments().at(1));
+    QVERIFY(updatesNeeded.isEmpty());
+    QCOMPARE(idErrors, QList<int>() << invalidId);
+
+    QCOMPARE(spy1.count(), 1);
+    QCOMPARE(spy2.count(), 1);
+
+    // An error is returned if none of the ids can be found
+    reply = iface.call("AboutToShowGroup", QVariant::fromValue(QList<int>() << invalidId));
+    QCOMPARE(reply.type(), QDBusMessage::ErrorMessage);
+}
+
+void DBusMenuExporterTest::testGetPeerAddress()
+{
+    QMenu inputMenu;
+    DBusMenuExporter exporter(TEST_OBJECT_PATH, &inputMenu);
+    QDBusInterface iface(TEST_SERVICE, TEST_OBJECT_PATH);
+
+    QDBusReply<QString> reply = iface.call("GetPeerAddress");
+    QVERIFY2(reply.isValid(), qPrintable(reply.error().message()));
+    QVERIFY(reply.value().isEmpty());
+    QVERIFY(!iface.property("QtExtensions").toStringList().contains("peer-to-peer"));
+
+    exporter.setPeerToPeerEnabled(true);
+    reply = iface.call("GetPeerAddress");
+    QVERIFY(!reply.value().isEmpty());
+    QVERIFY(iface.property("QtExtensions").toStringList().contains("peer-to-peer"));
+
+    exporter.setPeerToPeerEnabled(false);
+    reply = iface.call("GetPeerAddress");
+    QVERIFY(reply.value().isEmpty());
+    QVERIFY(!iface.property("QtExtensions").toStringList().contains("peer-to-peer"));
+}
+
+class LabelCollector : public DBusMenuLayoutVisitor
+{
+public:
+    void beginItem(int /*id*/, const QVariantMap &properties, int depth)
+    {
+        if (depth == 1) {
+            labels << properties.value("label").toString();
+        }
+    }
+
+    QStringList labels;
+};
+
+void DBusMenuExporterTest::testGetLayoutFd()
+{
+    QMenu inputMenu;
+    // Make the layout large enough to be passed as a file descriptor
+    const int count = 2000;
+    for (int pos = 0; pos < count; ++pos) {
+        inputMenu.addAction(QString("item %1 with a long enough label").arg(pos));
+    }
+    DBusMenuExporter exporter(TEST_OBJECT_PATH, &inputMenu);
+    QDBusInterface iface(TEST_SERVICE, TEST_OBJECT_PATH);
+
+    // Disabled by default
+    QDBusMessage reply = iface.call("GetLayoutFd", 0, -1, QStringList());
+    QCOMPARE(reply.type(), QDBusMessage::ErrorMessage);
+    QVERIFY(!iface.property("QtExtensions").toStringList().contains("layout-fd"));
+
+    exporter.setFileDescriptorPassingEnabled(true);
+    QVERIFY(iface.property("QtExtensions").toStringList().contains("layout-fd"));
+    reply = iface.call("GetLayoutFd", 0, -1, QStringList());
+    QCOMPARE(reply.type(), QDBusMessage::ReplyMessage);
+    QCOMPARE(reply.arguments().count(), 2);
+
+    QVariant payload = reply.arguments().at(1).value<QDBusVariant>().variant();
+    DBusMenuPayloadReader reader(payload);
+    QVERIFY(reader.isValid());
+
+    LabelCollector collector;
+    QDataStream stream(reader.data());
+    QVERIFY(DBusMenuTypes_readLayout(stream, &collector));
+    QCOMPARE(collector.labels.count(), count);
+    QCOMPARE(collector.labels.last(), QString("item %1 with a long enough label").arg(count - 1));
+}
+
 void DBusMenuExporterTest::testSubMenu()
 {
     QMenu inputMenu;
@@ -803,6 +1028,8 @@ void DBusMenuExporterTest::testGetIconDataProperty()
     DBusMenuItem item = itemlist.takeFirst();
     QVERIFY(!item.properties.contains("icon-name"));
     QVERIFY(item.properties.contains("icon-data"));
+    // Only sent when asked for
+    QVERIFY(!item.properties.contains("x-qt-icon-data-hash"));
 
     // Check saved image is the same
     QByteArray data = item.properties.value("icon-data").toByteArray();
@@ -812,4 +1039,278 @@ void DBusMenuExporterTest::testGetIconDataProperty()
     QCOMPARE(result, img);
 }
 
+void DBusMenuExporterTest::testGetIcons()
+{
+    QImage img(16, 16, QImage::Format_ARGB32);
+    img.fill(Qt::red);
+    QIcon icon(QPixmap::fromImage(img));
+
+    QMenu inputMenu;
+    inputMenu.addAction("a1")->setIcon(icon);
+    inputMenu.addAction("a2")->setIcon(icon);
+    DBusMenuExporter exporter(TEST_OBJECT_PATH, &inputMenu);
+
+    QDBusInterface iface(TEST_SERVICE, TEST_OBJECT_PATH);
+    QVERIFY(iface.property("QtExtensions").toStringList().contains("icon-data-hash"));
+
+    // Asking for the hash only does not send icon-data
+    DBusMenuLayoutItemList list = getChildren(&iface, 0, QStringList() << "x-qt-icon-data-hash");
+    QCOMPARE(list.count(), 2);
+    QVERIFY(!list[0].properties.contains("icon-data"));
+    QString hash = list[0].properties.value("x-qt-icon-data-hash").toString();
+    QVERIFY(!hash.isEmpty());
+    QCOMPARE(list[1].properties.value("x-qt-icon-data-hash").toString(), hash);
+
+    QDBusReply<QVariantMap> reply = iface.call("GetIcons", QStringList() << hash << "unknown");
+    QVERIFY2(reply.isValid(), qPrintable(reply.error().message()));
+    QVariantMap icons = reply.value();
+    QCOMPARE(icons.keys(), QStringList() << hash);
+
+    QImage result;
+    QVERIFY(result.loadFromData(icons.value(hash).toByteArray(), "PNG"));
+    QCOMPARE(result, img);
+}
+
+void DBusMenuExporterTest::testSlowAboutToShow()
+{
+    qRegisterMetaType<QMenu*>("QMenu*");
+
+    QMenu inputMenu;
+    inputMenu.addAction("a1");
+    Sleeper sleeper(200);
+    connect(&inputMenu, SIGNAL(aboutToShow()), &sleeper, SLOT(sleep()));
+
+    DBusMenuExporter exporter(TEST_OBJECT_PATH, &inputMenu);
+    QSignalSpy spy(&exporter, SIGNAL(slowAboutToShow(QMenu*, int)));
+
+    QDBusInterface iface(TEST_SERVICE, TEST_OBJECT_PATH);
+
+    // No deadline, no report
+    QDBusReply<bool> reply = iface.call("AboutToShow", 0);
+    QVERIFY2(reply.isValid(), qPrintable(reply.error().message()));
+    QCOMPARE(spy.count(), 0);
+
+    // The handler is slower than the deadline, it should be reported
+    exporter.setAboutToShowTimeout(100);
+    reply = iface.call("AboutToShow", 0);
+    QVERIFY2(reply.isValid(), qPrintable(reply.error().message()));
+    QCOMPARE(spy.count(), 1);
+    QVariantList args = spy.takeFirst();
+    QCOMPARE(args.at(0).value<QMenu*>(), &inputMenu);
+    QVERIFY(args.at(1).toInt() >= 200);
+}
+
+void DBusMenuExporterTest::testSnapshot()
+{
+    QMenu inputMenu;
+    QAction *a1 = inputMenu.addAction("a1");
+    QMenu *subMenu = inputMenu.addMenu("menu");
+    subMenu->addAction("a2");
+    QSignalSpy triggeredSpy(a1, SIGNAL(triggered()));
+    MenuFiller filler(subMenu);
+    filler.addAction(new QAction("a3", subMenu));
+
+    DBusMenuExporter exporter(TEST_OBJECT_PATH, &inputMenu);
+    QVERIFY(!exporter.isSnapshotEnabled());
+    exporter.setSnapshotEnabled(true);
+    QVERIFY(exporter.isSnapshotEnabled());
+
+    // GetLayout()
+    DBusMenuLayoutItemList list = getChildrenThroughBus(0, QStringList());
+    QCOMPARE(list.count(), 2);
+    int id1 = list.at(0).id;
+    int subMenuId = list.at(1).id;
+    QCOMPARE(list.at(0).properties.value("label").toString(), QString("a1"));
+    QCOMPARE(list.at(1).properties.value("children-display").toString(), QString("submenu"));
+    QCOMPARE(getChildrenThroughBus(subMenuId, QStringList()).count(), 1);
+
+    // GetProperty()
+    QDBusMessage reply = callThroughBus("GetProperty", QVariantList() << id1 << "label");
+    QCOMPARE(reply.type(), QDBusMessage::ReplyMessage);
+    QCOMPARE(reply.arguments().at(0).value<QDBusVariant>().variant().toString(), QString("a1"));
+
+    // GetGroupProperties()
+    QList<int> ids = QList<int>() << id1 << subMenuId;
+    reply = callThroughBus("GetGroupProperties", QVariantList() << QVariant::fromValue(ids) << (QStringList() << "label"));
+    QCOMPARE(reply.type(), QDBusMessage::ReplyMessage);
+    DBusMenuItemList items = qdbus_cast<DBusMenuItemList>(reply.arguments().at(0));
+    QCOMPARE(items.count(), 2);
+    QCOMPARE(items.at(0).id, id1);
+    QCOMPARE(items.at(0).properties.value("label").toString(), QString("a1"));
+    QCOMPARE(items.at(1).properties.value("label").toString(), QString("menu"));
+
+    // Event() is forwarded to the GUI thread
+    QDBusMessage event = createCall("Event", QVariantList()
+        << id1 << "clicked"
+        << QVariant::fromValue(QDBusVariant(QString()))
+        << QDateTime::currentDateTime().toTime_t());
+    QVERIFY(clientConnection().send(event));
+    QTest::qWait(500);
+    QCOMPARE(triggeredSpy.count(), 1);
+
+    // AboutToShow() is forwarded to the GUI thread, and the snapshot is
+    // updated before it is answered
+    reply = callThroughBus("AboutToShow", QVariantList() << subMenuId);
+    QCOMPARE(reply.type(), QDBusMessage::ReplyMessage);
+    QCOMPARE(reply.arguments().at(0).toBool(), true);
+    QCOMPARE(getChildrenThroughBus(subMenuId, QStringList()).count(), 2);
+
+    // Changes made in the GUI thread end up in the snapshot
+    a1->setText("renamed");
+    inputMenu.addAction("a4");
+    QTest::qWait(500);
+    list = getChildrenThroughBus(0, QStringList());
+    QCOMPARE(list.count(), 3);
+    QCOMPARE(list.at(0).properties.value("label").toString(), QString("renamed"));
+    QCOMPARE(list.at(2).properties.value("label").toString(), QString("a4"));
+
+    // The GUI thread answers again once snapshot mode is disabled
+    exporter.setSnapshotEnabled(false);
+    QVERIFY(!exporter.isSnapshotEnabled());
+    QCOMPARE(getChildrenThroughBus(0, QStringList()).count(), 3);
+}
+
+void DBusMenuExporterTest::testSnapshotWhileBusy()
+{
+    QMenu inputMenu;
+    inputMenu.addAction("a1");
+    inputMenu.addMenu("menu")->addAction("a2");
+    DBusMenuExporter exporter(TEST_OBJECT_PATH, &inputMenu);
+    exporter.setSnapshotEnabled(true);
+
+    // Keep the GUI thread busy while another thread reads the layout
+    BlockingLayoutCaller caller;
+    caller.start();
+    QTest::qSleep(1000);
+    bool finishedWhileBusy = caller.isFinished();
+    caller.wait();
+    QVERIFY(finishedWhileBusy);
+    QVERIFY(caller.m_elapsed < 1000);
+
+    QCOMPARE(caller.m_reply.type(), QDBusMessage::ReplyMessage);
+    DBusMenuLayoutItem root = qdbus_cast<DBusMenuLayoutItem>(caller.m_reply.arguments().at(1));
+    QCOMPARE(root.children.count(), 2);
+    QCOMPARE(root.children.at(1).children.count(), 1);
+    QCOMPARE(root.children.at(1).children.at(0).properties.value("label").toString(), QString("a2"));
+}
+
+void DBusMenuExporterTest::testDeferredAboutToShow()
+{
+    QMenu inputMenu;
+    QMenu *subMenu = inputMenu.addMenu("menu");
+    subMenu->addAction("a1");
+    QSignalSpy aboutToShowSpy(subMenu, SIGNAL(aboutToShow()));
+    DBusMenuExporter exporter(TEST_OBJECT_PATH, &inputMenu);
+    DeferredMenuFiller filler(&exporter, subMenu);
+    filler.addAction(new QAction("a2", subMenu));
+
+    DBusMenuLayoutItemList list = getChildrenThroughBus(0, QStringList());
+    QCOMPARE(list.count(), 1);
+    int subMenuId = list.first().id;
+
+    // The handler deferred its answer, so the call stays pending
+    QDBusPendingCall call1 = asyncCallThroughBus("AboutToShow", QVariantList() << subMenuId);
+    QTest::qWait(500);
+    QCOMPARE(aboutToShowSpy.count(), 1);
+    QVERIFY(!call1.isFinished());
+
+    // Other requests are served meanwhile
+    QCOMPARE(getChildrenThroughBus(subMenuId, QStringList()).count(), 1);
+
+    // A second call for the same menu waits for the same answer
+    QDBusPendingCall call2 = asyncCallThroughBus("AboutToShow", QVariantList() << subMenuId);
+    QTest::qWait(100);
+    QCOMPARE(aboutToShowSpy.count(), 1);
+    QVERIFY(!call2.isFinished());
+
+    filler.fill();
+    QDBusMessage reply = waitForReply(call1);
+    QCOMPARE(reply.type(), QDBusMessage::ReplyMessage);
+    QCOMPARE(reply.arguments().at(0).toBool(), true);
+    reply = waitForReply(call2);
+    QCOMPARE(reply.type(), QDBusMessage::ReplyMessage);
+    QCOMPARE(reply.arguments().at(0).toBool(), true);
+
+    QCOMPARE(getChildrenThroughBus(subMenuId, QStringList()).count(), 2);
+}
+
+void DBusMenuExporterTest::testDeferredAboutToShowMenuDestroyed()
+{
+    QMenu inputMenu;
+    QMenu *subMenu = inputMenu.addMenu("menu");
+    subMenu->addAction("a1");
+    DBusMenuExporter exporter(TEST_OBJECT_PATH, &inputMenu);
+    DeferredMenuFiller filler(&exporter, subMenu);
+
+    DBusMenuLayoutItemList list = getChildrenThroughBus(0, QStringList());
+    QCOMPARE(list.count(), 1);
+    int subMenuId = list.first().id;
+
+    QDBusPendingCall call = asyncCallThroughBus("AboutToShow", QVariantList() << subMenuId);
+    QTest::qWait(500);
+    QVERIFY(!call.isFinished());
+
+    // The pending call is answered when the menu goes away
+    delete subMenu;
+    QDBusMessage reply = waitForReply(call);
+    QCOMPARE(reply.type(), QDBusMessage::ReplyMessage);
+    QCOMPARE(reply.arguments().at(0).toBool(), false);
+}
+
+void DBusMenuExporterTest::testAboutToShowDeadline()
+{
+    qRegisterMetaType<QMenu*>("QMenu*");
+
+    QMenu inputMenu;
+    QMenu *subMenu = inputMenu.addMenu("menu");
+    QAction *a1 = subMenu->addAction("a1");
+    QSignalSpy aboutToShowSpy(subMenu, SIGNAL(aboutToShow()));
+    DBusMenuExporter exporter(TEST_OBJECT_PATH, &inputMenu);
+    exporter.setAboutToShowTimeout(300);
+    QCOMPARE(exporter.aboutToShowTimeout(), 300);
+    DeferredMenuFiller filler(&exporter, subMenu);
+    QSignalSpy slowSpy(&exporter, SIGNAL(slowAboutToShow(QMenu*, int)));
+
+    DBusMenuLayoutItemList list = getChildrenThroughBus(0, QStringList());
+    QCOMPARE(list.count(), 1);
+    int subMenuId = list.first().id;
+
+    ManualSignalSpy layoutSpy;
+    clientConnection().connect(TEST_SERVICE, TEST_OBJECT_PATH, "com.canonical.dbusmenu", "LayoutUpdated", "ui", &layoutSpy, SLOT(receiveCall(uint, int)));
+    QTest::qWait(500);
+    layoutSpy.clear();
+
+    // The handler is not done by the deadline: "no change" is answered then
+    QTime time;
+    time.start();
+    QDBusMessage reply = callThroughBus("AboutToShow", QVariantList() << subMenuId);
+    int elapsed = time.elapsed();
+    QCOMPARE(reply.type(), QDBusMessage::ReplyMessage);
+    QCOMPARE(reply.arguments().at(0).toBool(), false);
+    // Timers may fire slightly early
+    QVERIFY2(elapsed >= 250, qPrintable(QString::number(elapsed)));
+    QVERIFY2(elapsed < 2000, qPrintable(QString::number(elapsed)));
+
+    // Later calls are answered right away while the handler is running
+    time.restart();
+    reply = callThroughBus("AboutToShow", QVariantList() << subMenuId);
+    QCOMPARE(reply.type(), QDBusMessage::ReplyMessage);
+    QCOMPARE(reply.arguments().at(0).toBool(), false);
+    QVERIFY(time.elapsed() < 250);
+    QCOMPARE(aboutToShowSpy.count(), 1);
+    QCOMPARE(layoutSpy.count(), 0);
+
+    // Change a property only: LayoutUpdated then comes from the deadline
+    // handling, not from the layout change
+    a1->setText("renamed");
+    filler.fill();
+    QTest::qWait(500);
+    QCOMPARE(layoutSpy.count(), 1);
+    QCOMPARE(layoutSpy.first().at(1).toInt(), subMenuId);
+
+    QCOMPARE(slowSpy.count(), 1);
+    QCOMPARE(slowSpy.first().at(0).value<QMenu*>(), subMenu);
+    QVERIFY(slowSpy.first().at(1).toInt() >= 250);
+}
+
 #include "dbusmenuexportertest.moc"
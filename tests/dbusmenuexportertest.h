@@ -55,6 +55,17 @@ private Q_SLOTS:
     void testSeparatorCollapsing();
     void testSetStatus();
     void testGetIconDataProperty();
+    void testGetIcons();
+    void testSlowAboutToShow();
+    void testEventGroup();
+    void testAboutToShowGroup();
+    void testGetPeerAddress();
+    void testGetLayoutFd();
+    void testSnapshot();
+    void testSnapshotWhileBusy();
+    void testDeferredAboutToShow();
+    void testDeferredAboutToShowMenuDestroyed();
+    void testAboutToShowDeadline();
 
     void init();
     void cleanup();
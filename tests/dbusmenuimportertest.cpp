@@ -22,6 +22,8 @@
 #include "dbusmenuimportertest.h"
 
 // Qt
+#include <QBuffer>
+#include <QCryptographicHash>
 #include <QDBusConnection>
 #include <QDBusInterface>
 #include <QDBusReply>
@@ -31,6 +33,7 @@
 
 // DBusMenuQt
 #include <dbusmenuexporter.h>
+#include <dbusmenuicondecoder_p.h>
 #include <dbusmenuimporter.h>
 #include <debug_p.h>
 
@@ -86,6 +89,443 @@ void DBusMenuImporterTest::testAddingNewItem()
     QCOMPARE(outputMenu->actions().count(), inputMenu.actions().count());
 }
 
+void DBusMenuImporterTest::testSeveralImporters()
+{
+    QMenu inputMenu;
+    QAction *action = inputMenu.addAction("Test");
+    DBusMenuExporter exporter(TEST_OBJECT_PATH, &inputMenu);
+
+    // The importers share the signals of the exporter
+    DBusMenuImporter importer1(TEST_SERVICE, TEST_OBJECT_PATH);
+    DBusMenuImporter *importer2 = new DBusMenuImporter(TEST_SERVICE, TEST_OBJECT_PATH);
+    QTest::qWait(500);
+    QCOMPARE(importer1.menu()->actions().count(), 1);
+    QCOMPARE(importer2->menu()->actions().count(), 1);
+
+    inputMenu.addAction("Test2");
+    action->setText("Renamed");
+    QTest::qWait(500);
+    QCOMPARE(importer1.menu()->actions().count(), 2);
+    QCOMPARE(importer2->menu()->actions().count(), 2);
+    QCOMPARE(importer1.menu()->actions().first()->text(), QString("Renamed"));
+    QCOMPARE(importer2->menu()->actions().first()->text(), QString("Renamed"));
+
+    // Deleting one of them does not affect the other
+    delete importer2;
+    inputMenu.addAction("Test3");
+    QTest::qWait(500);
+    QCOMPARE(importer1.menu()->actions().count(), 3);
+}
+
+static bool waitForFirstActionText(DBusMenuImporter *importer, const QString &text)
+{
+    for (int i = 0; i < 200; ++i) {
+        QList<QAction *> actions = importer->menu()->actions();
+        if (!actions.isEmpty() && actions.first()->text() == text) {
+            return true;
+        }
+        QTest::qWait(10);
+    }
+    return false;
+}
+
+void DBusMenuImporterTest::testRebind()
+{
+    // A panel switching between 20 applications
+    static const int APP_COUNT = 20;
+    QList<QMenu *> menus;
+    QList<DBusMenuExporter *> exporters;
+    for (int app = 0; app < APP_COUNT; ++app) {
+        QMenu *menu = new QMenu;
+        menu->addAction(QString("app %1").arg(app));
+        menus << menu;
+        exporters << new DBusMenuExporter(QString("%1/%2").arg(TEST_OBJECT_PATH).arg(app), menu);
+    }
+    QTest::qWait(500);
+
+    // Rebinding the same importer to each of them
+    DBusMenuImporter importer(TEST_SERVICE, QString("%1/0").arg(TEST_OBJECT_PATH));
+    QVERIFY(waitForFirstActionText(&importer, "app 0"));
+    QPointer<QMenu> rootMenu = importer.menu();
+    for (int app = 0; app < APP_COUNT; ++app) {
+        importer.rebind(TEST_SERVICE, QString("%1/%2").arg(TEST_OBJECT_PATH).arg(app));
+        QVERIFY(waitForFirstActionText(&importer, QString("app %1").arg(app)));
+        QCOMPARE(importer.menu()->actions().count(), 1);
+    }
+    QCOMPARE(importer.menu(), rootMenu.data());
+
+    // Signals of the previous exporter are not received anymore
+    menus.first()->addAction("ignored");
+    menus.last()->addAction("received");
+    QTest::qWait(500);
+    QCOMPARE(importer.menu()->actions().count(), 2);
+    QCOMPARE(importer.menu()->actions().last()->text(), QString("received"));
+
+    qDeleteAll(exporters);
+    qDeleteAll(menus);
+}
+
+void DBusMenuImporterTest::testRebindWhileWaitingForAboutToShow()
+{
+    // The exporters live on a connection of their own so that they can
+    // delay their answers
+    const QString connectionName = "dbusmenuimportertest-rebind";
+    QDBusConnection connection = QDBusConnection::connectToBus(QDBusConnection::SessionBus, connectionName);
+    {
+        SilentExporter oldExporter;
+        SilentExporter newExporter;
+        QVERIFY(connection.registerObject("/OldMenu", &oldExporter, QDBusConnection::ExportAllContents));
+        QVERIFY(connection.registerObject("/NewMenu", &newExporter, QDBusConnection::ExportAllContents));
+
+        DBusMenuImporter importer(connection.baseService(), "/OldMenu");
+        importer.setTimeoutBounds(3000, 3000);
+        QTest::qWait(500);
+        QCOMPARE(importer.menu()->actions().count(), 1);
+
+        // Switch to another application while the menu waits for
+        // AboutToShow(): the wait ends right away instead of timing out
+        QMetaObject::invokeMethod(&importer, "rebind", Qt::QueuedConnection,
+            Q_ARG(QString, connection.baseService()), Q_ARG(QString, QString("/NewMenu")));
+        QTime time;
+        time.start();
+        importer.updateMenu();
+        QVERIFY(time.elapsed() < 1000);
+        QCOMPARE(oldExporter.pendingAboutToShowCalls.count(), 1);
+        QVERIFY(importer.isResponsive());
+
+        // The new exporter is not told that a menu of the previous one has
+        // been opened
+        QTest::qWait(500);
+        QCOMPARE(importer.menu()->actions().count(), 1);
+        QCOMPARE(newExporter.events, QStringList());
+        QCOMPARE(oldExporter.events, QStringList());
+    }
+    QDBusConnection::disconnectFromBus(connectionName);
+}
+
+// Service name owned by connections which come and go, unlike TEST_SERVICE
+static const char *TEST_RESTARTING_SERVICE = "com.canonical.dbusmenu-qt-test-restarting";
+
+void DBusMenuImporterTest::testExporterRestart()
+{
+    DBusMenuImporter importer(TEST_RESTARTING_SERVICE, TEST_OBJECT_PATH);
+    QMenu *outputMenu = importer.menu();
+
+    // First run of the exporter
+    const QString connectionName1 = "dbusmenuimportertest-restart1";
+    {
+        QDBusConnection connection = QDBusConnection::connectToBus(QDBusConnection::SessionBus, connectionName1);
+        QMenu inputMenu;
+        inputMenu.addAction("a1");
+        DBusMenuExporter exporter(TEST_OBJECT_PATH, &inputMenu, connection);
+        QVERIFY(connection.registerService(TEST_RESTARTING_SERVICE));
+        QTest::qWait(500);
+        QCOMPARE(outputMenu->actions().count(), 1);
+
+        inputMenu.addAction("a2");
+        QTest::qWait(500);
+        QCOMPARE(outputMenu->actions().count(), 2);
+    }
+    QDBusConnection::disconnectFromBus(connectionName1);
+    QTest::qWait(100);
+
+    // Second run: the name has a new owner, whose layout revisions start
+    // over
+    const QString connectionName2 = "dbusmenuimportertest-restart2";
+    {
+        QDBusConnection connection = QDBusConnection::connectToBus(QDBusConnection::SessionBus, connectionName2);
+        QMenu inputMenu;
+        inputMenu.addAction("b1");
+        DBusMenuExporter exporter(TEST_OBJECT_PATH, &inputMenu, connection);
+        QVERIFY(connection.registerService(TEST_RESTARTING_SERVICE));
+        QTest::qWait(500);
+        QCOMPARE(outputMenu->actions().count(), 1);
+        QCOMPARE(outputMenu->actions().first()->text(), QString("b1"));
+
+        // Signals of the new owner reach the importer
+        inputMenu.addAction("b2");
+        QTest::qWait(500);
+        QCOMPARE(outputMenu->actions().count(), 2);
+        QCOMPARE(outputMenu->actions().last()->text(), QString("b2"));
+    }
+    QDBusConnection::disconnectFromBus(connectionName2);
+}
+
+void DBusMenuImporterTest::testExporterStartedLater()
+{
+    DBusMenuImporter importer(TEST_RESTARTING_SERVICE, TEST_OBJECT_PATH);
+    QMenu *outputMenu = importer.menu();
+    QTest::qWait(500);
+    QCOMPARE(outputMenu->actions().count(), 0);
+
+    const QString connectionName = "dbusmenuimportertest-later";
+    {
+        QDBusConnection connection = QDBusConnection::connectToBus(QDBusConnection::SessionBus, connectionName);
+        QMenu inputMenu;
+        inputMenu.addAction("a1");
+        DBusMenuExporter exporter(TEST_OBJECT_PATH, &inputMenu, connection);
+        QVERIFY(connection.registerService(TEST_RESTARTING_SERVICE));
+        QTest::qWait(500);
+        QCOMPARE(outputMenu->actions().count(), 1);
+        QCOMPARE(outputMenu->actions().first()->text(), QString("a1"));
+
+        inputMenu.addAction("a2");
+        QTest::qWait(500);
+        QCOMPARE(outputMenu->actions().count(), 2);
+    }
+    QDBusConnection::disconnectFromBus(connectionName);
+}
+
+void DBusMenuImporterTest::testLayoutUpdateKeepsActions()
+{
+    QMenu inputMenu;
+    QAction *a1 = inputMenu.addAction("a1");
+    QAction *a2 = inputMenu.addAction("a2");
+    QAction *a3 = inputMenu.addAction("a3");
+    DBusMenuExporter exporter(TEST_OBJECT_PATH, &inputMenu);
+
+    DBusMenuImporter importer(TEST_SERVICE, TEST_OBJECT_PATH);
+    QTest::qWait(500);
+    QMenu *outputMenu = importer.menu();
+    QCOMPARE(outputMenu->actions().count(), 3);
+    QPointer<QAction> out1 = outputMenu->actions().at(0);
+    QPointer<QAction> out2 = outputMenu->actions().at(1);
+    QPointer<QAction> out3 = outputMenu->actions().at(2);
+
+    // Inserting an item must not recreate the others
+    QAction *inserted = new QAction("inserted", &inputMenu);
+    inputMenu.insertAction(a2, inserted);
+    QTest::qWait(500);
+    QCOMPARE(outputMenu->actions().count(), 4);
+    QCOMPARE(outputMenu->actions().at(0), out1.data());
+    QCOMPARE(outputMenu->actions().at(1)->text(), QString("inserted"));
+    QCOMPARE(outputMenu->actions().at(2), out2.data());
+    QCOMPARE(outputMenu->actions().at(3), out3.data());
+
+    // Removing an item deletes its action only
+    inputMenu.removeAction(a1);
+    QTest::qWait(500);
+    QCOMPARE(outputMenu->actions().count(), 3);
+    QVERIFY(out1.isNull());
+    QCOMPARE(outputMenu->actions().at(1), out2.data());
+    QCOMPARE(outputMenu->actions().at(2), out3.data());
+
+    // Moving an item gives it a new id, the other actions stay in place
+    inputMenu.removeAction(a3);
+    inputMenu.insertAction(inserted, a3);
+    QTest::qWait(500);
+    QCOMPARE(outputMenu->actions().count(), 3);
+    QCOMPARE(outputMenu->actions().at(0)->text(), QString("a3"));
+    QCOMPARE(outputMenu->actions().at(2), out2.data());
+}
+
+void DBusMenuImporterTest::testRefreshRepliesInAnyOrder()
+{
+    // The exporter lives on a connection of its own so that it can delay
+    // its answers
+    const QString connectionName = "dbusmenuimportertest-order";
+    QDBusConnection connection = QDBusConnection::connectToBus(QDBusConnection::SessionBus, connectionName);
+    {
+        DelayedLayoutExporter exporter(connection);
+        QVERIFY(connection.registerObject(TEST_OBJECT_PATH, &exporter, QDBusConnection::ExportAllContents));
+
+        DBusMenuImporter importer(connection.baseService(), TEST_OBJECT_PATH);
+        importer.setTimeoutBounds(3000, 3000);
+        QTest::qWait(500);
+        QMenu *outputMenu = importer.menu();
+        QCOMPARE(outputMenu->actions().count(), 2);
+
+        // Both submenus are refreshed after AboutToShowGroup(), the second
+        // one is answered first
+        exporter.label = "new";
+        exporter.layoutDelayForId.insert(1, 300);
+        exporter.layoutDelayForId.insert(2, 50);
+        QTime time;
+        time.start();
+        importer.updateMenu();
+        QVERIFY(time.elapsed() < 1000);
+        QCOMPARE(exporter.answeredIds, QList<int>() << 2 << 1);
+        QVERIFY(importer.isResponsive());
+
+        Q_FOREACH(QAction *action, outputMenu->actions()) {
+            QVERIFY(action->menu());
+            QCOMPARE(action->menu()->actions().count(), 1);
+            QCOMPARE(action->menu()->actions().first()->text(), QString("new"));
+        }
+    }
+    QDBusConnection::disconnectFromBus(connectionName);
+}
+
+void DBusMenuImporterTest::testAboutToShowSupersedesRunningRefresh()
+{
+    const QString connectionName = "dbusmenuimportertest-supersede";
+    QDBusConnection connection = QDBusConnection::connectToBus(QDBusConnection::SessionBus, connectionName);
+    {
+        DelayedLayoutExporter exporter(connection);
+        QVERIFY(connection.registerObject(TEST_OBJECT_PATH, &exporter, QDBusConnection::ExportAllContents));
+
+        DBusMenuImporter importer(connection.baseService(), TEST_OBJECT_PATH);
+        importer.setLayoutUpdateDelay(0);
+        importer.setTimeoutBounds(3000, 3000);
+        QTest::qWait(500);
+        QMenu *outputMenu = importer.menu();
+        QCOMPARE(outputMenu->actions().count(), 2);
+
+        // A refresh triggered by LayoutUpdated() is running...
+        exporter.layoutDelayForId.insert(0, 300);
+        exporter.emitLayoutUpdated();
+        QTest::qWait(50);
+        QVERIFY(exporter.answeredIds.isEmpty());
+
+        // ... when the menu is opened and its AboutToShow() handler changes
+        // it. The running refresh returns the old layout, so a new one must
+        // be sent.
+        exporter.updatesNeeded = QList<int>() << 0;
+        exporter.labelAfterAboutToShow = "new";
+        importer.updateMenu();
+        QTest::qWait(500);
+        QCOMPARE(exporter.answeredIds, QList<int>() << 0 << 0);
+
+        Q_FOREACH(QAction *action, outputMenu->actions()) {
+            QVERIFY(action->menu());
+            QCOMPARE(action->menu()->actions().count(), 1);
+            QCOMPARE(action->menu()->actions().first()->text(), QString("new"));
+        }
+    }
+    QDBusConnection::disconnectFromBus(connectionName);
+}
+
+void DBusMenuImporterTest::testNestedSubMenus()
+{
+    QMenu inputMenu;
+    QMenu *subMenu = inputMenu.addMenu("sub");
+    QMenu *subSubMenu = subMenu->addMenu("subsub");
+    subSubMenu->addAction("leaf");
+    DBusMenuExporter exporter(TEST_OBJECT_PATH, &inputMenu);
+
+    // The whole tree must be available without opening any menu
+    DBusMenuImporter importer(TEST_SERVICE, TEST_OBJECT_PATH);
+    QTest::qWait(500);
+    QMenu *outputMenu = importer.menu();
+    QCOMPARE(outputMenu->actions().count(), 1);
+    QMenu *outputSubMenu = outputMenu->actions().first()->menu();
+    QVERIFY(outputSubMenu);
+    QCOMPARE(outputSubMenu->actions().count(), 1);
+    QMenu *outputSubSubMenu = outputSubMenu->actions().first()->menu();
+    QVERIFY(outputSubSubMenu);
+    QCOMPARE(outputSubSubMenu->actions().count(), 1);
+    QCOMPARE(outputSubSubMenu->actions().first()->text(), QString("leaf"));
+
+    // Changing a deep item refreshes it in place
+    QPointer<QMenu> outputSubMenuGuard = outputSubMenu;
+    subSubMenu->addAction("leaf2");
+    QTest::qWait(500);
+    QVERIFY(!outputSubMenuGuard.isNull());
+    QCOMPARE(outputSubSubMenu->actions().count(), 2);
+}
+
+void DBusMenuImporterTest::testLayoutUpdateStorm()
+{
+    QMenu inputMenu;
+    QMenu *subMenu = inputMenu.addMenu("sub");
+    DBusMenuExporter exporter(TEST_OBJECT_PATH, &inputMenu);
+    DBusMenuImporter importer(TEST_SERVICE, TEST_OBJECT_PATH);
+    QTest::qWait(500);
+    QMenu *outputSubMenu = importer.menu()->actions().first()->menu();
+    QVERIFY(outputSubMenu);
+
+    // Changes keep coming while requests are running: the replies which
+    // are outdated must not win over the newer ones
+    for (int i = 0; i < 20; ++i) {
+        subMenu->addAction(QString::number(i));
+        QTest::qWait(i % 3);
+    }
+    QTest::qWait(500);
+    QCOMPARE(outputSubMenu->actions().count(), 20);
+    QCOMPARE(outputSubMenu->actions().last()->text(), QString("19"));
+}
+
+void DBusMenuImporterTest::testLayoutRevisions()
+{
+    DBusMenuImporter importer(TEST_SERVICE, TEST_OBJECT_PATH);
+    LayoutCounter counter;
+    QVERIFY(QDBusConnection::sessionBus().registerObject(TEST_OBJECT_PATH, &counter,
+        QDBusConnection::ExportAllSlots | QDBusConnection::ExportAllSignals));
+    QTest::qWait(500);
+    QCOMPARE(counter.getLayoutCount, 1);
+
+    // The layout we have is already at this revision
+    counter.emitLayoutUpdated(1, 0);
+    QTest::qWait(500);
+    QCOMPARE(counter.getLayoutCount, 1);
+
+    counter.revision = 2;
+    counter.emitLayoutUpdated(2, 0);
+    QTest::qWait(500);
+    QCOMPARE(counter.getLayoutCount, 2);
+
+    QDBusConnection::sessionBus().unregisterObject(TEST_OBJECT_PATH);
+}
+
+void DBusMenuImporterTest::testLayoutUpdateDelay()
+{
+    DBusMenuImporter importer(TEST_SERVICE, TEST_OBJECT_PATH);
+    QCOMPARE(importer.layoutUpdateDelay(), 0);
+    importer.setLayoutUpdateDelay(300);
+    QCOMPARE(importer.layoutUpdateDelay(), 300);
+
+    LayoutCounter counter;
+    QVERIFY(QDBusConnection::sessionBus().registerObject(TEST_OBJECT_PATH, &counter,
+        QDBusConnection::ExportAllSlots | QDBusConnection::ExportAllSignals));
+    QTest::qWait(500);
+    QCOMPARE(counter.getLayoutCount, 1);
+
+    // A burst of signals causes a single refresh
+    counter.revision = 4;
+    for (uint revision = 2; revision <= 4; ++revision) {
+        counter.emitLayoutUpdated(revision, 0);
+        QTest::qWait(50);
+    }
+    QTest::qWait(500);
+    QCOMPARE(counter.getLayoutCount, 2);
+
+    QDBusConnection::sessionBus().unregisterObject(TEST_OBJECT_PATH);
+}
+
+void DBusMenuImporterTest::testLazySubMenus()
+{
+    QMenu inputMenu;
+    QMenu *subMenu = inputMenu.addMenu("sub");
+    QMenu *subSubMenu = subMenu->addMenu("subsub");
+    subSubMenu->addAction("leaf");
+    DBusMenuExporter exporter(TEST_OBJECT_PATH, &inputMenu);
+
+    DBusMenuImporter importer(TEST_SERVICE, TEST_OBJECT_PATH);
+    importer.setPrefetchDepth(0);
+    QCOMPARE(importer.prefetchDepth(), 0);
+    QTest::qWait(500);
+
+    // Only the root menu has been fetched
+    QMenu *outputMenu = importer.menu();
+    QCOMPARE(outputMenu->actions().count(), 1);
+    QMenu *outputSubMenu = outputMenu->actions().first()->menu();
+    QVERIFY(outputSubMenu);
+    QVERIFY(outputSubMenu->actions().isEmpty());
+
+    // Showing a submenu fetches it, but not its own submenus
+    QMetaObject::invokeMethod(outputSubMenu, "aboutToShow");
+    QTest::qWait(500);
+    QCOMPARE(outputSubMenu->actions().count(), 1);
+    QMenu *outputSubSubMenu = outputSubMenu->actions().first()->menu();
+    QVERIFY(outputSubSubMenu);
+    QVERIFY(outputSubSubMenu->actions().isEmpty());
+
+    QMetaObject::invokeMethod(outputSubSubMenu, "aboutToShow");
+    QTest::qWait(500);
+    QCOMPARE(outputSubSubMenu->actions().count(), 1);
+    QCOMPARE(outputSubSubMenu->actions().first()->text(), QString("leaf"));
+}
+
 void DBusMenuImporterTest::testShortcut()
 {
     QMenu inputMenu;
@@ -124,6 +564,234 @@ void DBusMenuImporterTest::testDeletingImporterWhileWaitingForAboutToShow()
     slowMenuProcess.waitForFinished();
 }
 
+void DBusMenuImporterTest::testUnresponsiveApplication()
+{
+    // slowmenu takes 2 seconds to answer AboutToShow()
+    QProcess slowMenuProcess;
+    slowMenuProcess.start("./slowmenu");
+    QTest::qWait(500);
+
+    DBusMenuImporter importer(TEST_SERVICE, TEST_OBJECT_PATH);
+    importer.setTimeoutBounds(100, 100);
+    QTest::qWait(500);
+    QVERIFY(importer.isResponsive());
+    QSignalSpy spy(&importer, SIGNAL(responsivenessChanged(bool)));
+
+    // Each update times out
+    for (int i = 0; i < 3; ++i) {
+        importer.updateMenu();
+    }
+    QVERIFY(!importer.isResponsive());
+    QCOMPARE(spy.count(), 1);
+    QCOMPARE(spy.takeFirst().at(0).toBool(), false);
+
+    // Now menus do not wait anymore
+    QTime time;
+    time.start();
+    importer.updateMenu();
+    QVERIFY(time.elapsed() < 100);
+
+    // Until the application answers again
+    QTest::qWait(2500);
+    QVERIFY(importer.isResponsive());
+    QCOMPARE(spy.count(), 1);
+    QCOMPARE(spy.takeFirst().at(0).toBool(), true);
+
+    slowMenuProcess.close();
+    slowMenuProcess.waitForFinished();
+}
+
+void DBusMenuImporterTest::testHoverPrefetch()
+{
+    QMenu rootMenu;
+    QAction *a1 = rootMenu.addAction("a1");
+
+    QMenu subMenu;
+    MenuFiller subMenuFiller(&subMenu);
+    subMenuFiller.addAction(new QAction("a2", &subMenu));
+    a1->setMenu(&subMenu);
+
+    DBusMenuExporter exporter(TEST_OBJECT_PATH, &rootMenu);
+    DBusMenuImporter importer(TEST_SERVICE, TEST_OBJECT_PATH);
+    QTest::qWait(500);
+    QMenu *outputMenu = importer.menu();
+    QCOMPARE(outputMenu->actions().count(), 1);
+    QAction *a1Output = outputMenu->actions().first();
+    QMenu *outputSubMenu = a1Output->menu();
+    QVERIFY(outputSubMenu);
+    QCOMPARE(outputSubMenu->actions().count(), 0);
+
+    // Highlighting a1 must fill its submenu before it is shown
+    QMetaObject::invokeMethod(outputMenu, "hovered", Q_ARG(QAction*, a1Output));
+    QTest::qWait(500);
+    QCOMPARE(subMenu.actions().count(), 1);
+    QCOMPARE(outputSubMenu->actions().count(), 1);
+    QCOMPARE(outputSubMenu->actions().first()->text(), QString("a2"));
+
+    // Showing it now does not change anything
+    QMetaObject::invokeMethod(outputSubMenu, "aboutToShow");
+    QTest::qWait(500);
+    QCOMPARE(outputSubMenu->actions().count(), 1);
+}
+
+void DBusMenuImporterTest::testNonBlocking()
+{
+    QMenu rootMenu;
+    MenuFiller rootMenuFiller(&rootMenu);
+    rootMenuFiller.addAction(new QAction("a1", &rootMenu));
+    rootMenuFiller.addAction(new QAction("a2", &rootMenu));
+
+    DBusMenuExporter exporter(TEST_OBJECT_PATH, &rootMenu);
+    DBusMenuImporter importer(TEST_SERVICE, TEST_OBJECT_PATH, NONBLOCKING);
+    QTest::qWait(500);
+    QMenu *outputMenu = importer.menu();
+    QCOMPARE(outputMenu->actions().count(), 0);
+
+    // The menu can be shown right away, with its current content
+    QSignalSpy spy(&importer, SIGNAL(menuUpdated()));
+    QSignalSpy spyReady(&importer, SIGNAL(menuReadyToBeShown()));
+    importer.updateMenu();
+    QCOMPARE(spyReady.count(), 1);
+    QCOMPARE(spy.count(), 0);
+    QCOMPARE(outputMenu->actions().count(), 0);
+
+    // Then it gets updated
+    QTest::qWait(500);
+    QCOMPARE(spy.count(), 1);
+    QCOMPARE(outputMenu->actions().count(), 2);
+}
+
+void DBusMenuImporterTest::testBackgroundRevalidation()
+{
+    QMenu rootMenu;
+    rootMenu.addAction("a1");
+    MenuFiller rootMenuFiller(&rootMenu);
+    rootMenuFiller.addAction(new QAction("a2", &rootMenu));
+
+    DBusMenuExporter exporter(TEST_OBJECT_PATH, &rootMenu);
+    DBusMenuImporter importer(TEST_SERVICE, TEST_OBJECT_PATH);
+    importer.setBackgroundRevalidationEnabled(true);
+    QVERIFY(importer.isBackgroundRevalidationEnabled());
+    QTest::qWait(500);
+    QMenu *outputMenu = importer.menu();
+    QCOMPARE(outputMenu->actions().count(), 1);
+    QPointer<QAction> a1Output = outputMenu->actions().first();
+
+    // The fetched content is shown right away...
+    QSignalSpy spy(&importer, SIGNAL(menuUpdated()));
+    QSignalSpy spyReady(&importer, SIGNAL(menuReadyToBeShown()));
+    importer.updateMenu();
+    QCOMPARE(spyReady.count(), 1);
+    QCOMPARE(spy.count(), 0);
+    QCOMPARE(outputMenu->actions().count(), 1);
+
+    // ...then updated in place
+    QTest::qWait(500);
+    QCOMPARE(spy.count(), 1);
+    QCOMPARE(outputMenu->actions().count(), 2);
+    QCOMPARE(outputMenu->actions().first(), a1Output.data());
+}
+
+void DBusMenuImporterTest::testAdaptiveTimeouts()
+{
+    QMenu inputMenu;
+    DBusMenuExporter exporter(TEST_OBJECT_PATH, &inputMenu);
+    DBusMenuImporter importer(TEST_SERVICE, TEST_OBJECT_PATH);
+    QCOMPARE(importer.minimumTimeout(), 500);
+    QCOMPARE(importer.maximumTimeout(), 10000);
+
+    // Without measures, the default timeouts are used
+    QCOMPARE(importer.aboutToShowTimeout(), 3000);
+    QCOMPARE(importer.refreshTimeout(), 4000);
+
+    importer.setTimeoutBounds(200, 20000);
+    QCOMPARE(importer.minimumTimeout(), 200);
+    QCOMPARE(importer.maximumTimeout(), 20000);
+
+    // A responsive application gets shorter timeouts
+    for (int i = 0; i < 10; ++i) {
+        inputMenu.addAction(QString::number(i));
+        QTest::qWait(100);
+    }
+    QCOMPARE(importer.menu()->actions().count(), 10);
+    QVERIFY(importer.refreshTimeout() < 4000);
+    QVERIFY(importer.refreshTimeout() >= 200);
+
+    // Timeouts stay within the bounds
+    importer.setTimeoutBounds(5000, 20000);
+    QCOMPARE(importer.refreshTimeout(), 5000);
+}
+
+void DBusMenuImporterTest::testPeerToPeer()
+{
+    QMenu inputMenu;
+    inputMenu.addAction("Test");
+    DBusMenuExporter exporter(TEST_OBJECT_PATH, &inputMenu);
+    exporter.setPeerToPeerEnabled(true);
+    QVERIFY(exporter.isPeerToPeerEnabled());
+
+    DBusMenuImporter importer(TEST_SERVICE, TEST_OBJECT_PATH);
+    QTest::qWait(500);
+    QMenu *outputMenu = importer.menu();
+    QCOMPARE(outputMenu->actions().count(), 1);
+
+    // Once the importer is connected to the peer, the exporter does not need
+    // to be on the bus anymore
+    QDBusConnection::sessionBus().unregisterObject(TEST_OBJECT_PATH);
+    inputMenu.addAction("Test2");
+    QTest::qWait(500);
+    QCOMPARE(outputMenu->actions().count(), 2);
+    QCOMPARE(outputMenu->actions().at(1)->text(), QString("Test2"));
+}
+
+void DBusMenuImporterTest::testPeerToPeerDisabled()
+{
+    QMenu inputMenu;
+    inputMenu.addAction("Test");
+    DBusMenuExporter exporter(TEST_OBJECT_PATH, &inputMenu);
+    exporter.setPeerToPeerEnabled(true);
+
+    DBusMenuImporter importer(TEST_SERVICE, TEST_OBJECT_PATH);
+    QTest::qWait(500);
+    QMenu *outputMenu = importer.menu();
+    QCOMPARE(outputMenu->actions().count(), 1);
+
+    // The exporter closes the peer-to-peer connection: the importer must go
+    // back to the bus and catch up with the changes it missed
+    exporter.setPeerToPeerEnabled(false);
+    inputMenu.addAction("Test2");
+    QTest::qWait(2000);
+    QCOMPARE(outputMenu->actions().count(), 2);
+    QCOMPARE(outputMenu->actions().at(1)->text(), QString("Test2"));
+
+    // Signals are received on the bus again
+    inputMenu.addAction("Test3");
+    QTest::qWait(500);
+    QCOMPARE(outputMenu->actions().count(), 3);
+    QCOMPARE(outputMenu->actions().at(2)->text(), QString("Test3"));
+}
+
+void DBusMenuImporterTest::testLayoutFd()
+{
+    QMenu inputMenu;
+    QAction *action = inputMenu.addAction("Test");
+    action->setShortcut(Qt::CTRL | Qt::Key_S);
+    DBusMenuExporter exporter(TEST_OBJECT_PATH, &inputMenu);
+    exporter.setFileDescriptorPassingEnabled(true);
+
+    DBusMenuImporter importer(TEST_SERVICE, TEST_OBJECT_PATH);
+    QTest::qWait(500);
+    QMenu *outputMenu = importer.menu();
+    QCOMPARE(outputMenu->actions().count(), 1);
+
+    // This layout is fetched with GetLayoutFd()
+    inputMenu.addAction("Test2");
+    QTest::qWait(500);
+    QCOMPARE(outputMenu->actions().count(), 2);
+    QCOMPARE(outputMenu->actions().at(0)->shortcut(), action->shortcut());
+    QCOMPARE(outputMenu->actions().at(1)->text(), QString("Test2"));
+}
+
 void DBusMenuImporterTest::testDynamicMenu()
 {
     QMenu rootMenu;
@@ -288,6 +956,255 @@ void DBusMenuImporterTest::testIconData()
     QCOMPARE(origBytes,resultBytes);
 }
 
+void DBusMenuImporterTest::testIconDataHash()
+{
+    QImage img(16, 16, QImage::Format_ARGB32);
+    img.fill(Qt::red);
+    QIcon redIcon(QPixmap::fromImage(img));
+    img.fill(Qt::green);
+    QIcon greenIcon(QPixmap::fromImage(img));
+
+    QMenu inputMenu;
+    inputMenu.addAction("a1")->setIcon(redIcon);
+    DBusMenuExporter exporter(TEST_OBJECT_PATH, &inputMenu);
+
+    DBusMenuImporter importer(TEST_SERVICE, TEST_OBJECT_PATH);
+    QTest::qWait(500);
+    QMenu *outputMenu = importer.menu();
+    QCOMPARE(outputMenu->actions().count(), 1);
+
+    // The new layout only contains hashes: the red icon is already known,
+    // the green one must be fetched with GetIcons()
+    inputMenu.addAction("a2")->setIcon(redIcon);
+    inputMenu.addAction("a3")->setIcon(greenIcon);
+    QTest::qWait(500);
+    QCOMPARE(outputMenu->actions().count(), 3);
+
+    QImage red = outputMenu->actions().at(1)->icon().pixmap(16).toImage();
+    QImage green = outputMenu->actions().at(2)->icon().pixmap(16).toImage();
+    QCOMPARE(red.pixel(8, 8), QColor(Qt::red).rgb());
+    QCOMPARE(green.pixel(8, 8), QColor(Qt::green).rgb());
+}
+
+static QByteArray pngData(const QIcon &icon)
+{
+    QBuffer buffer;
+    icon.pixmap(16).save(&buffer, "PNG");
+    return buffer.data();
+}
+
+static QString dataHash(const QByteArray &data)
+{
+    return QString::fromLatin1(QCryptographicHash::hash(data, QCryptographicHash::Sha1).toHex());
+}
+
+void DBusMenuImporterTest::testForgedIconData()
+{
+    // Use a color no other test uses, so that the icon is not in the cache
+    QImage img(16, 16, QImage::Format_ARGB32);
+    img.fill(QColor(12, 34, 56));
+    QIcon genuineIcon(QPixmap::fromImage(img));
+    img.fill(Qt::green);
+    QIcon forgedIcon(QPixmap::fromImage(img));
+
+    // An application announces the hash of the icon of another one, but
+    // sends other data
+    ForgedIconExporter forger;
+    forger.announcedHash = dataHash(pngData(genuineIcon));
+    forger.sentData = pngData(forgedIcon);
+    const QString forgerPath = "/ForgedIcons";
+    QVERIFY(QDBusConnection::sessionBus().registerObject(forgerPath, &forger, QDBusConnection::ExportAllContents));
+
+    DBusMenuImporter forgerImporter(TEST_SERVICE, forgerPath);
+    QTest::qWait(500);
+    QMenu *outputMenu = forgerImporter.menu();
+    QCOMPARE(outputMenu->actions().count(), 1);
+    QVERIFY(outputMenu->actions().first()->icon().isNull());
+
+    // The application owning the icon still gets it right
+    QMenu inputMenu;
+    inputMenu.addAction("a1")->setIcon(genuineIcon);
+    DBusMenuExporter exporter(TEST_OBJECT_PATH, &inputMenu);
+
+    DBusMenuImporter importer(TEST_SERVICE, TEST_OBJECT_PATH);
+    QTest::qWait(500);
+    outputMenu = importer.menu();
+    QCOMPARE(outputMenu->actions().count(), 1);
+    QImage result = outputMenu->actions().first()->icon().pixmap(16).toImage();
+    QCOMPARE(result.pixel(8, 8), QColor(12, 34, 56).rgb());
+}
+
+void DBusMenuImporterTest::testIconCache()
+{
+    QImage img(16, 16, QImage::Format_ARGB32);
+    img.fill(Qt::blue);
+    QIcon icon(QPixmap::fromImage(img));
+
+    QMenu inputMenu;
+    for (int pos = 0; pos < 10; ++pos) {
+        inputMenu.addAction(QString("a%1").arg(pos))->setIcon(icon);
+    }
+    DBusMenuExporter exporter(TEST_OBJECT_PATH, &inputMenu);
+
+    qint64 hitCount = DBusMenuImporter::iconCacheHitCount();
+    qint64 missCount = DBusMenuImporter::iconCacheMissCount();
+
+    // The icon is decoded once for all the actions...
+    DBusMenuImporter importer1(TEST_SERVICE, TEST_OBJECT_PATH);
+    QTest::qWait(500);
+    QCOMPARE(importer1.menu()->actions().count(), 10);
+    QVERIFY(!importer1.menu()->actions().last()->icon().isNull());
+    QCOMPARE(DBusMenuImporter::iconCacheMissCount() - missCount, qint64(1));
+    QCOMPARE(DBusMenuImporter::iconCacheHitCount() - hitCount, qint64(0));
+
+    // ... then found in the cache by other importers
+    DBusMenuImporter importer2(TEST_SERVICE, TEST_OBJECT_PATH);
+    QTest::qWait(500);
+    QCOMPARE(importer2.menu()->actions().count(), 10);
+    QVERIFY(!importer2.menu()->actions().last()->icon().isNull());
+    QCOMPARE(DBusMenuImporter::iconCacheMissCount() - missCount, qint64(1));
+    QCOMPARE(DBusMenuImporter::iconCacheHitCount() - hitCount, qint64(10));
+}
+
+static QByteArray colorPngData(const QColor &color)
+{
+    QImage img(16, 16, QImage::Format_ARGB32);
+    img.fill(color);
+    return pngData(QIcon(QPixmap::fromImage(img)));
+}
+
+static QRgb iconColor(QAction *action)
+{
+    return action->icon().pixmap(16).toImage().pixel(8, 8);
+}
+
+void DBusMenuImporterTest::testIconsDecodedLater()
+{
+    // Colors no other test uses, so that the icons are not in the cache
+    const QColor color1(10, 20, 30);
+    const QColor color2(40, 50, 60);
+    const QColor color3(70, 80, 90);
+    QByteArray data1 = colorPngData(color1);
+    QByteArray data2 = colorPngData(color2);
+    QByteArray data3 = colorPngData(color3);
+
+    // The exporter lives on a connection of its own so that it can delay
+    // its answers
+    const QString connectionName = "dbusmenuimportertest-icons";
+    QDBusConnection connection = QDBusConnection::connectToBus(QDBusConnection::SessionBus, connectionName);
+    {
+        DelayedIconExporter exporter(connection);
+        exporter.itemHashes << dataHash(data1) << dataHash(data1) << dataHash(data2);
+        exporter.iconDataForHash.insert(dataHash(data1), data1);
+        exporter.iconDataForHash.insert(dataHash(data2), data2);
+        QVERIFY(connection.registerObject(TEST_OBJECT_PATH, &exporter, QDBusConnection::ExportAllContents));
+
+        QSignalSpy decodedSpy(DBusMenuIconDecoder::instance(), SIGNAL(iconDecoded(QString, QIcon)));
+        DBusMenuImporter importer(connection.baseService(), TEST_OBJECT_PATH);
+        QTest::qWait(500);
+
+        // The menu is built without waiting for its icons
+        QMenu *outputMenu = importer.menu();
+        QCOMPARE(outputMenu->actions().count(), 3);
+        Q_FOREACH(QAction *action, outputMenu->actions()) {
+            QVERIFY(action->icon().isNull());
+        }
+        QCOMPARE(exporter.pendingGetIconsCalls.count(), 1);
+        QCOMPARE(decodedSpy.count(), 0);
+
+        // Meanwhile an action goes away, and another one gets a new icon,
+        // which is decoded right away
+        QAction *a1 = outputMenu->actions().at(0);
+        delete outputMenu->actions().at(1);
+        QAction *a3 = outputMenu->actions().at(1);
+        exporter.emitIconData(3, data3);
+        QTest::qWait(500);
+        QCOMPARE(decodedSpy.count(), 1);
+        QCOMPARE(decodedSpy.first().at(0).toString(), dataHash(data3));
+        QCOMPARE(iconColor(a3), color3.rgb());
+        QVERIFY(a1->icon().isNull());
+
+        // The icons of the first layout arrive once decoded. The deleted
+        // action is skipped and a3 keeps its newer icon.
+        exporter.answerGetIcons();
+        QTest::qWait(500);
+        QCOMPARE(decodedSpy.count(), 3);
+        QStringList decodedHashes;
+        Q_FOREACH(const QVariantList &args, decodedSpy) {
+            decodedHashes << args.at(0).toString();
+        }
+        QVERIFY(decodedHashes.contains(dataHash(data1)));
+        QVERIFY(decodedHashes.contains(dataHash(data2)));
+        QCOMPARE(iconColor(a1), color1.rgb());
+        QCOMPARE(iconColor(a3), color3.rgb());
+    }
+    QDBusConnection::disconnectFromBus(connectionName);
+}
+
+// Exports actions whose icon names are the color of the icon
+class ColorIconExporter : public DBusMenuExporter
+{
+public:
+    ColorIconExporter(const QString &path, QMenu *menu)
+    : DBusMenuExporter(path, menu)
+    {}
+
+protected:
+    QString iconNameForAction(QAction *action)
+    {
+        return action->property("iconName").toString();
+    }
+};
+
+static QAction *addColorIconAction(QMenu *menu, const QString &color)
+{
+    QAction *action = menu->addAction(color);
+    action->setProperty("iconName", color);
+    return action;
+}
+
+void DBusMenuImporterTest::testIconNameCache()
+{
+    // Add actions after creating the exporter, so that our reimplementation
+    // of iconNameForAction() is used
+    QMenu inputMenu;
+    ColorIconExporter exporter(TEST_OBJECT_PATH, &inputMenu);
+    addColorIconAction(&inputMenu, "red");
+    addColorIconAction(&inputMenu, "red");
+    addColorIconAction(&inputMenu, "green");
+
+    NamedIconImporter importer(TEST_SERVICE, TEST_OBJECT_PATH);
+    QTest::qWait(500);
+    QMenu *outputMenu = importer.menu();
+    QCOMPARE(outputMenu->actions().count(), 3);
+    QVERIFY(!outputMenu->actions().at(1)->icon().isNull());
+    QCOMPARE(importer.iconForNameCount, 2);
+
+    // Known names are not resolved again
+    addColorIconAction(&inputMenu, "green");
+    QTest::qWait(500);
+    QCOMPARE(outputMenu->actions().count(), 4);
+    QCOMPARE(importer.iconForNameCount, 2);
+}
+
+void DBusMenuImporterTest::testBatchedIconNames()
+{
+    QMenu inputMenu;
+    ColorIconExporter exporter(TEST_OBJECT_PATH, &inputMenu);
+    addColorIconAction(&inputMenu, "red");
+    addColorIconAction(&inputMenu, "green");
+    addColorIconAction(&inputMenu, "red");
+
+    BatchNamedIconImporter importer(TEST_SERVICE, TEST_OBJECT_PATH);
+    QTest::qWait(500);
+    QMenu *outputMenu = importer.menu();
+    QCOMPARE(outputMenu->actions().count(), 3);
+    QVERIFY(!outputMenu->actions().at(2)->icon().isNull());
+    QCOMPARE(importer.iconForNameCount, 0);
+    QCOMPARE(importer.batches.count(), 1);
+    QCOMPARE(importer.batches.first(), QStringList() << "red" << "green");
+}
+
 void DBusMenuImporterTest::testInvisibleItem()
 {
     QMenu inputMenu;
@@ -25,10 +25,379 @@
 #include <QtGui>
 
 // Qt
+#include <QDBusConnection>
+#include <QDBusContext>
+#include <QDBusMessage>
+#include <QDBusVariant>
 #include <QObject>
 
+// DBusMenuQt
+#include <dbusmenuimporter.h>
+#include <dbusmenutypes_p.h>
+
 // Local
 
+/**
+ * Counts calls to iconForName()
+ */
+class NamedIconImporter : public DBusMenuImporter
+{
+Q_OBJECT
+public:
+    NamedIconImporter(const QString &service, const QString &path)
+    : DBusMenuImporter(service, path)
+    , iconForNameCount(0)
+    {}
+
+    int iconForNameCount;
+
+protected:
+    QIcon iconForName(const QString &name)
+    {
+        ++iconForNameCount;
+        return QIcon(makePixmap(name));
+    }
+
+    static QPixmap makePixmap(const QString &name)
+    {
+        QPixmap pix(16, 16);
+        pix.fill(QColor(name));
+        return pix;
+    }
+};
+
+/**
+ * Resolves icon names in batches
+ */
+class BatchNamedIconImporter : public NamedIconImporter
+{
+Q_OBJECT
+public:
+    BatchNamedIconImporter(const QString &service, const QString &path)
+    : NamedIconImporter(service, path)
+    {}
+
+    QList<QStringList> batches;
+
+    Q_INVOKABLE QVariantMap iconsForNames(const QStringList &names)
+    {
+        batches << names;
+        QVariantMap map;
+        Q_FOREACH(const QString &name, names) {
+            map.insert(name, QIcon(makePixmap(name)));
+        }
+        return map;
+    }
+};
+
+/**
+ * Minimal exporter of an empty menu, counting GetLayout() calls
+ */
+class LayoutCounter : public QObject
+{
+Q_OBJECT
+Q_CLASSINFO("D-Bus Interface", "com.canonical.dbusmenu")
+public:
+    LayoutCounter()
+    : getLayoutCount(0)
+    , revision(1)
+    {}
+
+    int getLayoutCount;
+    uint revision;
+
+    void emitLayoutUpdated(uint rev, int parentId)
+    {
+        LayoutUpdated(rev, parentId);
+    }
+
+public Q_SLOTS:
+    uint GetLayout(int parentId, int /*recursionDepth*/, const QStringList &/*propertyNames*/, DBusMenuLayoutItem &item)
+    {
+        ++getLayoutCount;
+        item.id = parentId;
+        return revision;
+    }
+
+Q_SIGNALS:
+    void LayoutUpdated(uint revision, int parentId);
+};
+
+/**
+ * Minimal exporter of a menu with one item, whose icon data does not match
+ * the hash it announces
+ */
+class ForgedIconExporter : public QObject
+{
+Q_OBJECT
+Q_CLASSINFO("D-Bus Interface", "com.canonical.dbusmenu")
+Q_PROPERTY(uint Version READ version)
+Q_PROPERTY(QStringList QtExtensions READ qtExtensions)
+public:
+    QString announcedHash;
+    QByteArray sentData;
+
+    uint version() const
+    {
+        return 3;
+    }
+
+    QStringList qtExtensions() const
+    {
+        return QStringList() << "icon-data-hash";
+    }
+
+public Q_SLOTS:
+    uint GetLayout(int parentId, int /*recursionDepth*/, const QStringList &/*propertyNames*/, DBusMenuLayoutItem &item)
+    {
+        item.id = parentId;
+        if (parentId == 0) {
+            DBusMenuLayoutItem child;
+            child.id = 1;
+            child.properties.insert("label", QString("a1"));
+            child.properties.insert("x-qt-icon-data-hash", announcedHash);
+            item.children << child;
+        }
+        return 1;
+    }
+
+    QVariantMap GetIcons(const QStringList &hashes)
+    {
+        QVariantMap map;
+        Q_FOREACH(const QString &hash, hashes) {
+            map.insert(hash, sentData);
+        }
+        return map;
+    }
+};
+
+/**
+ * Minimal exporter of a menu whose items have icons. GetIcons() is only
+ * answered when answerGetIcons() is called.
+ */
+class DelayedIconExporter : public QObject, protected QDBusContext
+{
+Q_OBJECT
+Q_CLASSINFO("D-Bus Interface", "com.canonical.dbusmenu")
+Q_PROPERTY(uint Version READ version)
+Q_PROPERTY(QStringList QtExtensions READ qtExtensions)
+public:
+    DelayedIconExporter(const QDBusConnection &connection)
+    : m_connection(connection)
+    {}
+
+    // Icon hash of each item. Item ids start at 1.
+    QStringList itemHashes;
+    QVariantMap iconDataForHash;
+    QList<QDBusMessage> pendingGetIconsCalls;
+
+    uint version() const
+    {
+        return 3;
+    }
+
+    QStringList qtExtensions() const
+    {
+        return QStringList() << "icon-data-hash";
+    }
+
+    void answerGetIcons()
+    {
+        QDBusMessage call = pendingGetIconsCalls.takeFirst();
+        QVariantMap map;
+        Q_FOREACH(const QString &hash, call.arguments().at(0).toStringList()) {
+            map.insert(hash, iconDataForHash.value(hash));
+        }
+        m_connection.send(call.createReply(QVariant(map)));
+    }
+
+    void emitIconData(int id, const QByteArray &data)
+    {
+        DBusMenuItem item;
+        item.id = id;
+        item.properties.insert("icon-data", data);
+        ItemsPropertiesUpdated(DBusMenuItemList() << item, DBusMenuItemKeysList());
+    }
+
+public Q_SLOTS:
+    uint GetLayout(int parentId, int /*recursionDepth*/, const QStringList &/*propertyNames*/, DBusMenuLayoutItem &item)
+    {
+        item.id = parentId;
+        if (parentId == 0) {
+            for (int pos = 0; pos < itemHashes.count(); ++pos) {
+                DBusMenuLayoutItem child;
+                child.id = pos + 1;
+                child.properties.insert("label", QString("a%1").arg(pos + 1));
+                child.properties.insert("x-qt-icon-data-hash", itemHashes.at(pos));
+                item.children << child;
+            }
+        }
+        return 1;
+    }
+
+    QVariantMap GetIcons(const QStringList &/*hashes*/)
+    {
+        setDelayedReply(true);
+        pendingGetIconsCalls << message();
+        return QVariantMap();
+    }
+
+Q_SIGNALS:
+    void ItemsPropertiesUpdated(DBusMenuItemList, DBusMenuItemKeysList);
+
+private:
+    QDBusConnection m_connection;
+};
+
+/**
+ * Minimal exporter of a menu with one item, which never answers
+ * AboutToShow() and records the events it receives
+ */
+class SilentExporter : public QObject, protected QDBusContext
+{
+Q_OBJECT
+Q_CLASSINFO("D-Bus Interface", "com.canonical.dbusmenu")
+public:
+    QList<QDBusMessage> pendingAboutToShowCalls;
+    // "<id> <eventId>" for each event
+    QStringList events;
+
+public Q_SLOTS:
+    uint GetLayout(int parentId, int /*recursionDepth*/, const QStringList &/*propertyNames*/, DBusMenuLayoutItem &item)
+    {
+        item.id = parentId;
+        if (parentId == 0) {
+            DBusMenuLayoutItem child;
+            child.id = 1;
+            child.properties.insert("label", QString("a1"));
+            item.children << child;
+        }
+        return 1;
+    }
+
+    bool AboutToShow(int /*id*/)
+    {
+        setDelayedReply(true);
+        pendingAboutToShowCalls << message();
+        return false;
+    }
+
+    void Event(int id, const QString &eventId, const QDBusVariant &/*data*/, uint /*timestamp*/)
+    {
+        events << QString("%1 %2").arg(id).arg(eventId);
+    }
+};
+
+/**
+ * Minimal exporter of a root menu with two submenus of one item each.
+ * GetLayout() for id is answered after layoutDelayForId[id] milliseconds,
+ * with the layout of the time of the call.
+ */
+class DelayedLayoutExporter : public QObject, protected QDBusContext
+{
+Q_OBJECT
+Q_CLASSINFO("D-Bus Interface", "com.canonical.dbusmenu")
+Q_PROPERTY(uint Version READ version)
+public:
+    DelayedLayoutExporter(const QDBusConnection &connection)
+    : label("old")
+    , revision(1)
+    , m_connection(connection)
+    {
+        updatesNeeded << 1 << 2;
+    }
+
+    // Label of the items of the submenus
+    QString label;
+    uint revision;
+    QHash<int, int> layoutDelayForId;
+    // Ids of the delayed GetLayout() calls, in the order they were answered
+    QList<int> answeredIds;
+    // Returned by AboutToShowGroup()
+    QList<int> updatesNeeded;
+    // If set, AboutToShowGroup() changes label to it, then emits
+    // LayoutUpdated() after answering, like DBusMenuExporter does
+    QString labelAfterAboutToShow;
+
+    uint version() const
+    {
+        return 3;
+    }
+
+public Q_SLOTS:
+    uint GetLayout(int parentId, int /*recursionDepth*/, const QStringList &/*propertyNames*/, DBusMenuLayoutItem &item)
+    {
+        fillLayout(parentId, item);
+        if (layoutDelayForId.contains(parentId)) {
+            setDelayedReply(true);
+            QTimer *timer = new QTimer(this);
+            timer->setSingleShot(true);
+            timer->setProperty("id", parentId);
+            connect(timer, SIGNAL(timeout()), SLOT(answerGetLayout()));
+            m_replyForTimer.insert(timer,
+                message().createReply(QVariantList() << QVariant(revision) << QVariant::fromValue(item)));
+            timer->start(layoutDelayForId.value(parentId));
+        }
+        return revision;
+    }
+
+    QList<int> AboutToShowGroup(const QList<int> &/*ids*/, QList<int> &idErrors)
+    {
+        idErrors.clear();
+        if (!labelAfterAboutToShow.isEmpty()) {
+            label = labelAfterAboutToShow;
+            QTimer::singleShot(0, this, SLOT(slotAboutToShowAnswered()));
+        }
+        return updatesNeeded;
+    }
+
+    void emitLayoutUpdated()
+    {
+        ++revision;
+        LayoutUpdated(revision, 0);
+    }
+
+Q_SIGNALS:
+    void LayoutUpdated(uint revision, int parentId);
+
+private Q_SLOTS:
+    void slotAboutToShowAnswered()
+    {
+        emitLayoutUpdated();
+    }
+
+    void answerGetLayout()
+    {
+        QTimer *timer = static_cast<QTimer *>(sender());
+        timer->deleteLater();
+        m_connection.send(m_replyForTimer.take(timer));
+        answeredIds << timer->property("id").toInt();
+    }
+
+private:
+    void fillLayout(int id, DBusMenuLayoutItem &item) const
+    {
+        item.id = id;
+        if (id == 0) {
+            for (int subId = 1; subId <= 2; ++subId) {
+                DBusMenuLayoutItem subItem;
+                fillLayout(subId, subItem);
+                item.children << subItem;
+            }
+        } else if (id == 1 || id == 2) {
+            item.properties.insert("label", QString("sub%1").arg(id));
+            item.properties.insert("children-display", QString("submenu"));
+            DBusMenuLayoutItem child;
+            child.id = id + 2;
+            child.properties.insert("label", label);
+            item.children << child;
+        }
+    }
+
+    QDBusConnection m_connection;
+    QHash<QTimer *, QDBusMessage> m_replyForTimer;
+};
+
 class DBusMenuImporterTest : public QObject
 {
 Q_OBJECT
@@ -36,12 +405,39 @@ private Q_SLOTS:
     void cleanup();
     void testStandardItem();
     void testAddingNewItem();
+    void testSeveralImporters();
+    void testExporterRestart();
+    void testExporterStartedLater();
+    void testRebind();
+    void testRebindWhileWaitingForAboutToShow();
+    void testLayoutUpdateKeepsActions();
+    void testRefreshRepliesInAnyOrder();
+    void testAboutToShowSupersedesRunningRefresh();
+    void testNestedSubMenus();
+    void testLayoutUpdateStorm();
+    void testLayoutRevisions();
+    void testLayoutUpdateDelay();
+    void testLazySubMenus();
     void testShortcut();
     void testDeletingImporterWhileWaitingForAboutToShow();
     void testDynamicMenu();
+    void testHoverPrefetch();
+    void testNonBlocking();
+    void testBackgroundRevalidation();
+    void testAdaptiveTimeouts();
+    void testUnresponsiveApplication();
+    void testPeerToPeer();
+    void testPeerToPeerDisabled();
+    void testLayoutFd();
     void testActionActivationRequested();
     void testActionsAreDeletedWhenImporterIs();
     void testIconData();
+    void testIconDataHash();
+    void testForgedIconData();
+    void testIconCache();
+    void testIconsDecodedLater();
+    void testIconNameCache();
+    void testBatchedIconNames();
     void testInvisibleItem();
     void testDisabledItem();
 
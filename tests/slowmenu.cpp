@@ -31,19 +31,29 @@ static const char *TEST_OBJECT_PATH = "/TestMenuBar";
 
 SlowMenu::SlowMenu()
 : QMenu()
+, m_exporter(0)
 {
     connect(this, SIGNAL(aboutToShow()), SLOT(slotAboutToShow()));
 }
 
+void SlowMenu::setExporter(DBusMenuExporter *exporter)
+{
+    m_exporter = exporter;
+}
+
 void SlowMenu::slotAboutToShow()
 {
     qDebug() << __FUNCTION__ << "Entering";
-    QTime time;
-    time.start();
-    while (time.elapsed() < 2000) {
-        qApp->processEvents();
-    }
+    // Pretend we need 2 seconds to populate the menu, without blocking the
+    // event loop
+    m_exporter->deferAboutToShow(this);
+    QTimer::singleShot(2000, this, SLOT(slotPopulated()));
+}
+
+void SlowMenu::slotPopulated()
+{
     qDebug() << __FUNCTION__ << "Leaving";
+    m_exporter->finishAboutToShow(this);
 }
 
 int main(int argc, char** argv)
@@ -53,6 +63,7 @@ int main(int argc, char** argv)
     SlowMenu* inputMenu = new SlowMenu;
     inputMenu->addAction("Test");
     DBusMenuExporter exporter(TEST_OBJECT_PATH, inputMenu);
+    inputMenu->setExporter(&exporter);
     qDebug() << "Looping";
     return app.exec();
 }
@@ -23,14 +23,22 @@
 
 #include <QMenu>
 
+class DBusMenuExporter;
+
 class SlowMenu : public QMenu
 {
 Q_OBJECT
 public:
     SlowMenu();
 
+    void setExporter(DBusMenuExporter *exporter);
+
 public Q_SLOTS:
     void slotAboutToShow();
+    void slotPopulated();
+
+private:
+    DBusMenuExporter *m_exporter;
 };
 
 
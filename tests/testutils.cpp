@@ -20,7 +20,10 @@
 */
 #include "testutils.h"
 
+#include <dbusmenuexporter.h>
+
 #include <QCoreApplication>
+#include <QtTest>
 
 void waitForDeferredDeletes()
 {
@@ -31,4 +34,22 @@ void waitForDeferredDeletes()
     }
 }
 
+void DeferredMenuFiller::defer()
+{
+    m_exporter->deferAboutToShow(m_menu);
+}
+
+void DeferredMenuFiller::fill()
+{
+    while (!m_actions.isEmpty()) {
+        m_menu->addAction(m_actions.takeFirst());
+    }
+    m_exporter->finishAboutToShow(m_menu);
+}
+
+void Sleeper::sleep()
+{
+    QTest::qSleep(m_msecs);
+}
+
 #include "testutils.moc"
@@ -30,6 +30,8 @@
 #include <QMenu>
 #include <QVariant>
 
+class DBusMenuExporter;
+
 class ManualSignalSpy : public QObject, public QList<QVariantList>
 {
     Q_OBJECT
@@ -104,6 +106,51 @@ private:
     QList<QAction *> m_actions;
 };
 
+/**
+ * Populates a menu asynchronously: its aboutToShow() handler defers the
+ * answer of the exporter until fill() is called
+ */
+class DeferredMenuFiller : public QObject
+{
+    Q_OBJECT
+public:
+    DeferredMenuFiller(DBusMenuExporter *exporter, QMenu *menu)
+    : m_exporter(exporter)
+    , m_menu(menu)
+    {
+        connect(m_menu, SIGNAL(aboutToShow()), SLOT(defer()));
+    }
+
+    void addAction(QAction *action)
+    {
+        m_actions << action;
+    }
+
+public Q_SLOTS:
+    void defer();
+    void fill();
+
+private:
+    DBusMenuExporter *m_exporter;
+    QMenu *m_menu;
+    QList<QAction *> m_actions;
+};
+
+class Sleeper : public QObject
+{
+    Q_OBJECT
+public:
+    Sleeper(int msecs)
+    : m_msecs(msecs)
+    {}
+
+public Q_SLOTS:
+    void sleep();
+
+private:
+    int m_msecs;
+};
+
 void waitForDeferredDeletes();
 
 #endif /* TESTUTILS_H */